@@ -10,91 +10,94 @@
 #include "hal_gpio.h"
 #include "pio_asm.h"
 #include "capture.h"
+#include "decoder.h"
 #include "display.h"
 #include "globals.h"
+#include "utils.h"
 
 /*- Definitions -------------------------------------------------------------*/
 #define CORE1_STACK_SIZE       512 // words
 
+#define DMA_RING_SIZE          1024 // words, must be a power of 2
+#define DMA_RING_BITS          12   // log2(DMA_RING_SIZE * sizeof(uint32_t))
+#define DMA_TIME_RING_SIZE     512 // words, must be a power of 2
+#define DMA_TIME_RING_BITS     11  // log2(DMA_TIME_RING_SIZE * sizeof(uint32_t))
+#define DMA_DREQ_PIO0_RX0      4
+#define DMA_DREQ_PIO1_RX1      13
+#define DMA_TREQ_PERMANENT     0x3f
+#define DMA_RESYNC_ATTEMPTS    8    // Attempts to find the packet boundary per call, about 6 us each
+
+#define SPEED_DETECT_TIME      1000 // us, one frame or keep-alive period
+#define RATE_WINDOW            (1000 * CAPTURE_TICKS_PER_US) // The peak packet rate is measured over 1 ms
+
+#define INDEX_SIZE             (BUFFER_SIZE / 2 / DECODER_INDEX_STEP + 1) // Records take at least 2 words
+#define DATA_SIZE              (BUFFER_SIZE - 2 * INDEX_SIZE) // Packet offsets and frame counts
+
+#define STREAM_MAX_RECORD      320 // words, enough for the largest FS packet
+#define STREAM_FOLD_QUEUE      64  // packets
+#define STREAM_WRAP            0xffffffff
+#define TRIGGER_PATTERN_SIZE   8
+#define FILTER_LIST_SIZE       16
+
 // DP and DM can be any pins, but they must be consequitive and in that order
 #define DP_INDEX       10
 #define DM_INDEX       11
 #define START_INDEX    12
+#define STROBE_INDEX   13
 
 HAL_GPIO_PIN(DP,       0, 10, pio0_10)
 HAL_GPIO_PIN(DM,       0, 11, pio0_11)
 HAL_GPIO_PIN(START,    0, 12, pio1_12) // Internal trigger from PIO1 to PIO0
+HAL_GPIO_PIN(STROBE,   0, 13, pio0_13) // Internal EOP strobe from PIO0 to the PIO1 timestamp counter
 HAL_GPIO_PIN(TRIGGER,  0, 18, sio_18)
 
 /*- Constants ---------------------------------------------------------------*/
-static const uint16_t crc16_usb_tab[256] =
-{
-  0x0000, 0xc0c1, 0xc181, 0x0140, 0xc301, 0x03c0, 0x0280, 0xc241,
-  0xc601, 0x06c0, 0x0780, 0xc741, 0x0500, 0xc5c1, 0xc481, 0x0440,
-  0xcc01, 0x0cc0, 0x0d80, 0xcd41, 0x0f00, 0xcfc1, 0xce81, 0x0e40,
-  0x0a00, 0xcac1, 0xcb81, 0x0b40, 0xc901, 0x09c0, 0x0880, 0xc841,
-  0xd801, 0x18c0, 0x1980, 0xd941, 0x1b00, 0xdbc1, 0xda81, 0x1a40,
-  0x1e00, 0xdec1, 0xdf81, 0x1f40, 0xdd01, 0x1dc0, 0x1c80, 0xdc41,
-  0x1400, 0xd4c1, 0xd581, 0x1540, 0xd701, 0x17c0, 0x1680, 0xd641,
-  0xd201, 0x12c0, 0x1380, 0xd341, 0x1100, 0xd1c1, 0xd081, 0x1040,
-  0xf001, 0x30c0, 0x3180, 0xf141, 0x3300, 0xf3c1, 0xf281, 0x3240,
-  0x3600, 0xf6c1, 0xf781, 0x3740, 0xf501, 0x35c0, 0x3480, 0xf441,
-  0x3c00, 0xfcc1, 0xfd81, 0x3d40, 0xff01, 0x3fc0, 0x3e80, 0xfe41,
-  0xfa01, 0x3ac0, 0x3b80, 0xfb41, 0x3900, 0xf9c1, 0xf881, 0x3840,
-  0x2800, 0xe8c1, 0xe981, 0x2940, 0xeb01, 0x2bc0, 0x2a80, 0xea41,
-  0xee01, 0x2ec0, 0x2f80, 0xef41, 0x2d00, 0xedc1, 0xec81, 0x2c40,
-  0xe401, 0x24c0, 0x2580, 0xe541, 0x2700, 0xe7c1, 0xe681, 0x2640,
-  0x2200, 0xe2c1, 0xe381, 0x2340, 0xe101, 0x21c0, 0x2080, 0xe041,
-  0xa001, 0x60c0, 0x6180, 0xa141, 0x6300, 0xa3c1, 0xa281, 0x6240,
-  0x6600, 0xa6c1, 0xa781, 0x6740, 0xa501, 0x65c0, 0x6480, 0xa441,
-  0x6c00, 0xacc1, 0xad81, 0x6d40, 0xaf01, 0x6fc0, 0x6e80, 0xae41,
-  0xaa01, 0x6ac0, 0x6b80, 0xab41, 0x6900, 0xa9c1, 0xa881, 0x6840,
-  0x7800, 0xb8c1, 0xb981, 0x7940, 0xbb01, 0x7bc0, 0x7a80, 0xba41,
-  0xbe01, 0x7ec0, 0x7f80, 0xbf41, 0x7d00, 0xbdc1, 0xbc81, 0x7c40,
-  0xb401, 0x74c0, 0x7580, 0xb541, 0x7700, 0xb7c1, 0xb681, 0x7640,
-  0x7200, 0xb2c1, 0xb381, 0x7340, 0xb101, 0x71c0, 0x7080, 0xb041,
-  0x5000, 0x90c1, 0x9181, 0x5140, 0x9301, 0x53c0, 0x5280, 0x9241,
-  0x9601, 0x56c0, 0x5780, 0x9741, 0x5500, 0x95c1, 0x9481, 0x5440,
-  0x9c01, 0x5cc0, 0x5d80, 0x9d41, 0x5f00, 0x9fc1, 0x9e81, 0x5e40,
-  0x5a00, 0x9ac1, 0x9b81, 0x5b40, 0x9901, 0x59c0, 0x5880, 0x9841,
-  0x8801, 0x48c0, 0x4980, 0x8941, 0x4b00, 0x8bc1, 0x8a81, 0x4a40,
-  0x4e00, 0x8ec1, 0x8f81, 0x4f40, 0x8d01, 0x4dc0, 0x4c80, 0x8c41,
-  0x4400, 0x84c1, 0x8581, 0x4540, 0x8701, 0x47c0, 0x4680, 0x8641,
-  0x8201, 0x42c0, 0x4380, 0x8341, 0x4100, 0x81c1, 0x8081, 0x4040,
-};
-
-static const uint8_t crc5_usb_tab[256] =
-{
-  0x00, 0x0e, 0x1c, 0x12, 0x11, 0x1f, 0x0d, 0x03, 0x0b, 0x05, 0x17, 0x19, 0x1a, 0x14, 0x06, 0x08,
-  0x16, 0x18, 0x0a, 0x04, 0x07, 0x09, 0x1b, 0x15, 0x1d, 0x13, 0x01, 0x0f, 0x0c, 0x02, 0x10, 0x1e,
-  0x05, 0x0b, 0x19, 0x17, 0x14, 0x1a, 0x08, 0x06, 0x0e, 0x00, 0x12, 0x1c, 0x1f, 0x11, 0x03, 0x0d,
-  0x13, 0x1d, 0x0f, 0x01, 0x02, 0x0c, 0x1e, 0x10, 0x18, 0x16, 0x04, 0x0a, 0x09, 0x07, 0x15, 0x1b,
-  0x0a, 0x04, 0x16, 0x18, 0x1b, 0x15, 0x07, 0x09, 0x01, 0x0f, 0x1d, 0x13, 0x10, 0x1e, 0x0c, 0x02,
-  0x1c, 0x12, 0x00, 0x0e, 0x0d, 0x03, 0x11, 0x1f, 0x17, 0x19, 0x0b, 0x05, 0x06, 0x08, 0x1a, 0x14,
-  0x0f, 0x01, 0x13, 0x1d, 0x1e, 0x10, 0x02, 0x0c, 0x04, 0x0a, 0x18, 0x16, 0x15, 0x1b, 0x09, 0x07,
-  0x19, 0x17, 0x05, 0x0b, 0x08, 0x06, 0x14, 0x1a, 0x12, 0x1c, 0x0e, 0x00, 0x03, 0x0d, 0x1f, 0x11,
-  0x14, 0x1a, 0x08, 0x06, 0x05, 0x0b, 0x19, 0x17, 0x1f, 0x11, 0x03, 0x0d, 0x0e, 0x00, 0x12, 0x1c,
-  0x02, 0x0c, 0x1e, 0x10, 0x13, 0x1d, 0x0f, 0x01, 0x09, 0x07, 0x15, 0x1b, 0x18, 0x16, 0x04, 0x0a,
-  0x11, 0x1f, 0x0d, 0x03, 0x00, 0x0e, 0x1c, 0x12, 0x1a, 0x14, 0x06, 0x08, 0x0b, 0x05, 0x17, 0x19,
-  0x07, 0x09, 0x1b, 0x15, 0x16, 0x18, 0x0a, 0x04, 0x0c, 0x02, 0x10, 0x1e, 0x1d, 0x13, 0x01, 0x0f,
-  0x1e, 0x10, 0x02, 0x0c, 0x0f, 0x01, 0x13, 0x1d, 0x15, 0x1b, 0x09, 0x07, 0x04, 0x0a, 0x18, 0x16,
-  0x08, 0x06, 0x14, 0x1a, 0x19, 0x17, 0x05, 0x0b, 0x03, 0x0d, 0x1f, 0x11, 0x12, 0x1c, 0x0e, 0x00,
-  0x1b, 0x15, 0x07, 0x09, 0x0a, 0x04, 0x16, 0x18, 0x10, 0x1e, 0x0c, 0x02, 0x01, 0x0f, 0x1d, 0x13,
-  0x0d, 0x03, 0x11, 0x1f, 0x1c, 0x12, 0x00, 0x0e, 0x06, 0x08, 0x1a, 0x14, 0x17, 0x19, 0x0b, 0x05,
-};
-
 static const char *capture_speed_str[CaptureSpeedCount] =
 {
   [CaptureSpeed_Low]  = "Low",
   [CaptureSpeed_Full] = "Full",
+  [CaptureSpeed_Auto] = "Auto",
+};
+
+static const char *capture_mode_str[CaptureModeCount] =
+{
+  [CaptureMode_Polling]   = "Polling",
+  [CaptureMode_Dma]       = "DMA",
+  [CaptureMode_Streaming] = "Streaming",
 };
 
 static const char *capture_trigger_str[CaptureTriggerCount] =
 {
-  [CaptureTrigger_Enabled]  = "Enabled",
+  [CaptureTrigger_External] = "External input",
+  [CaptureTrigger_Setup]    = "SETUP packet",
+  [CaptureTrigger_Stall]    = "STALL handshake",
+  [CaptureTrigger_Reset]    = "Bus reset",
+  [CaptureTrigger_Error]    = "Packet error",
+  [CaptureTrigger_Match]    = "Address / endpoint / data match",
   [CaptureTrigger_Disabled] = "Disabled",
 };
 
+static const char *capture_pretrigger_str[CapturePretriggerCount] =
+{
+  [CapturePretrigger_None] = "None",
+  [CapturePretrigger_10]   = "10% of the buffer",
+  [CapturePretrigger_50]   = "50% of the buffer",
+  [CapturePretrigger_90]   = "90% of the buffer",
+  [CapturePretrigger_100]  = "All of the buffer (stop on trigger)",
+};
+
+static const char *capture_fold_str[CaptureFoldCount] =
+{
+  [CaptureFold_Disabled] = "Disabled",
+  [CaptureFold_Enabled]  = "Enabled",
+};
+
+static const char *capture_decode_str[CaptureDecodeCount] =
+{
+  [CaptureDecode_Disabled] = "Disabled",
+  [CaptureDecode_Enabled]  = "Enabled",
+};
+
 static const char *capture_limit_str[CaptureLimitCount] =
 {
   [CaptureLimit_100]       = "100 packets",
@@ -129,254 +132,166 @@ static const char *display_fold_str[DisplayFoldCount] =
   [DisplayFold_Disabled] = "Disabled",
 };
 
+static const char *display_filter_str[DisplayFilterCount] =
+{
+  [DisplayFilter_All]        = "All packets",
+  [DisplayFilter_NoSof]      = "All except SOF",
+  [DisplayFilter_Tokens]     = "Tokens",
+  [DisplayFilter_Data]       = "Data",
+  [DisplayFilter_Handshakes] = "Handshakes",
+  [DisplayFilter_Errors]     = "Errors only",
+};
+
+static const char *display_view_str[DisplayViewCount] =
+{
+  [DisplayView_Packets]      = "Packets",
+  [DisplayView_Transactions] = "Transactions",
+};
+
+static const char *display_output_str[DisplayOutputCount] =
+{
+  [DisplayOutput_Text]   = "Text",
+  [DisplayOutput_Binary] = "Binary",
+};
+
 /*- Variables ---------------------------------------------------------------*/
 uint32_t g_buffer[BUFFER_SIZE];
 buffer_info_t g_buffer_info;
 
 int g_capture_speed   = CaptureSpeed_Full;
+int g_capture_mode    = CaptureMode_Polling;
 int g_capture_trigger = CaptureTrigger_Disabled;
+int g_capture_pretrigger = CapturePretrigger_None;
 int g_capture_limit   = CaptureLimit_Unlimited;
+int g_capture_fold    = CaptureFold_Disabled;
+int g_capture_decode  = CaptureDecode_Disabled;
 int g_display_time    = DisplayTime_SOF;
 int g_display_data    = DisplayData_Full;
 int g_display_fold    = DisplayFold_Enabled;
-
-static int g_rd_ptr    = 0;
-static int g_wr_ptr    = 0;
-static int g_sof_index = 0;
-static bool g_may_fold = false;
+int g_display_filter  = DisplayFilter_All;
+uint32_t g_display_address[4] = { 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff };
+uint32_t g_display_endpoint = 0xffff;
+int g_display_view    = DisplayView_Packets;
+int g_display_output  = DisplayOutput_Text;
+
+static decoder_ctx_t g_decode_ctx;
+static int g_fold_sof;     // Start of the SOF record of the current frame
+static int g_fold_run;     // Start of the folded run record right before the current frame
+static int g_fold_run_end; // End of the compact run record
+static uint32_t g_fold_sof_time;  // Time of the compact SOF record
+static uint32_t g_fold_sof_delta; // Time delta stored in the compact SOF record
+static uint32_t g_fold_run_time;  // Time of the compact run record
+static int g_fold_packets; // Number of packets in the current frame
+static bool g_fold_empty;  // The current frame contains only SOF, IN and NAK packets
+static decoder_t g_decoder;
+static uint32_t g_decode_words[2];
+static int g_decode_held;  // Number of data words not decoded yet
+static int g_decode_count; // Number of data words received for the current packet
+static bool g_decode_overflow;
+static bool g_decode_sync_error;
+static uint32_t g_decode_time_offset;
+static uint32_t g_decode_prev_time; // Time of the last compact record
+static uint32_t g_packet_record[DECODER_MAX_RECORD];
+
+static uint32_t g_rate_start; // Start of the current peak rate window
+static int g_rate_count;      // Packets in the current peak rate window
+
+static uint32_t g_dma_ring[DMA_RING_SIZE] __attribute__((aligned(DMA_RING_SIZE * sizeof(uint32_t))));
+static uint32_t g_dma_rd_ptr;      // Free running, the words read from the ring
+static uint32_t g_dma_checked;     // Read pointer at the last overrun check
+static uint32_t g_dma_wr_base;     // Words written before the last restart of the channel
+static uint32_t g_dma_wr_left;     // Transfer count at the last check
+static uint32_t g_dma_time_ring[DMA_TIME_RING_SIZE] __attribute__((aligned(DMA_TIME_RING_SIZE * sizeof(uint32_t))));
+static uint32_t g_dma_time_rd_ptr;
+static uint32_t g_dma_time_checked;
+static uint32_t g_dma_time_wr_base;
+static uint32_t g_dma_time_wr_left;
+static bool g_dma_skip;            // Discard the words up to the end of the first packet
+static bool g_dma_resync;          // The reading is not synchronized to the packet boundary
+static bool g_dma_overflow;        // The ring was overrun, marked the same way as the FIFO overflow
+static const uint32_t g_dma_trans_count = 0xffffffff;
+
+static int g_pending_cmd; // Command received outside of the capture loop
+
+static bool g_streaming = false;
+static bool g_stream_drop;
+static bool g_stream_may_fold;
+static bool g_stream_overflow;
+static bool g_stream_overwrite; // Discard the oldest records instead of the new ones
+static bool g_stream_sync_error;
+static int g_stream_head;  // Start of the record being captured
+static int g_stream_index; // Write index within the record being captured
+static int g_stream_limit; // Write limit for the record being captured
+static int g_stream_end;   // End of the last complete record
+static int g_stream_tail;  // Start of the oldest record not yet consumed
+static int g_stream_count; // Number of packets received from the PIO
+static int g_stream_trigger; // Start of the first record after the trigger
+static uint32_t g_stream_time_offset;
+static uint32_t g_stream_queue[STREAM_FOLD_QUEUE][4];
+static int g_stream_queue_size;
+static int g_trigger_address = -1; // -1 matches any address
+static int g_trigger_endpoint = -1; // -1 matches any endpoint
+static uint8_t g_trigger_pattern[TRIGGER_PATTERN_SIZE];
+static int g_trigger_pattern_size;
+static bool g_trigger_token; // The last token matched the address and the endpoint
 
 /*- Implementations ---------------------------------------------------------*/
 
 //-----------------------------------------------------------------------------
-static uint16_t crc16_usb(uint8_t *data, int size)
-{
-  uint16_t crc = 0xffff;
-
-  for (int i = 0; i < size; i++)
-    crc = crc16_usb_tab[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
-
-  return crc;
-}
-
-//-----------------------------------------------------------------------------
-static uint8_t crc5_usb(uint8_t *data, int size)
-{
-  uint8_t crc = 0xff;
-
-  for (int i = 0; i < size; i++)
-    crc = crc5_usb_tab[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
-
-  return crc;
-}
-
-//-----------------------------------------------------------------------------
-static void handle_folding(int pid, uint32_t error)
+static void handle_folding(int record, int pid, uint32_t error)
 {
   if (error)
   {
-    g_buffer_info.errors++;
     set_error(true);
+    g_decode_ctx.errors++;
   }
 
   if (pid == Pid_Sof)
   {
-    g_buffer_info.frames++;
+    g_decode_ctx.frames++;
 
-    if (g_may_fold)
+    if (g_decode_ctx.may_fold)
     {
-      g_buffer[g_sof_index] |= CAPTURE_MAY_FOLD;
-      g_buffer_info.folded++;
+      ((uint8_t *)g_buffer)[g_decode_ctx.sof_index] |= DECODER_COMPACT_MAY_FOLD;
+      g_decode_ctx.folded++;
     }
 
-    g_sof_index = g_wr_ptr-2;
-    g_may_fold = true;
+    g_decode_ctx.sof_index = record;
+    g_decode_ctx.may_fold = true;
   }
   else if (pid != Pid_In && pid != Pid_Nak)
   {
-    g_may_fold = false;
+    g_decode_ctx.may_fold = false;
   }
 
   if (error)
-    g_may_fold = false;
-}
-
-//-----------------------------------------------------------------------------
-static void process_packet(int size)
-{
-  uint8_t *out_data = (uint8_t *)&g_buffer[g_wr_ptr];
-  uint32_t v = 0x80000000;
-  uint32_t error = 0;
-  int out_size = 0;
-  int out_bit = 0;
-  int out_byte = 0;
-  int stuff_count = 0;
-  int pid, npid;
-
-  while (size)
-  {
-    uint32_t w = g_buffer[g_rd_ptr++];
-    int bit_count;
-
-    if (size < 31)
-    {
-      w <<= (30-size);
-      bit_count = size;
-    }
-    else
-    {
-      bit_count = 31;
-    }
-
-    v ^= (w ^ (w << 1));
-
-    for (int i = 0; i < bit_count; i++)
-    {
-      int bit = (v & 0x80000000) ? 0 : 1;
-
-      v <<= 1;
-
-      if (stuff_count == 6)
-      {
-        if (bit)
-          error |= CAPTURE_ERROR_STUFF;
-
-        stuff_count = 0;
-        continue;
-      }
-      else if (bit)
-        stuff_count++;
-      else
-        stuff_count = 0;
-
-      out_byte |= (bit << out_bit);
-      out_bit++;
-
-      if (out_bit == 8)
-      {
-        out_data[out_size++] = out_byte;
-        out_byte = 0;
-        out_bit = 0;
-      }
-    }
-
-    size -= bit_count;
-  }
-
-  if (out_bit)
-    error |= CAPTURE_ERROR_NBIT;
-
-  if (out_size < 1)
-  {
-    error |= CAPTURE_ERROR_SIZE;
-    return;
-  }
-
-  if (out_data[0] != (g_buffer_info.fs ? 0x80 : 0x81))
-    error |= CAPTURE_ERROR_SYNC;
-
-  if (out_size < 2)
-  {
-    error |= CAPTURE_ERROR_SIZE;
-    return;
-  }
-
-  pid = out_data[1] & 0x0f;
-  npid = (~out_data[1] >> 4) & 0x0f;
-
-  if ((pid != npid) || (pid == Pid_Reserved))
-    error |= CAPTURE_ERROR_PID;
-
-  if (pid == Pid_Sof || pid == Pid_In || pid == Pid_Out || pid == Pid_Setup || pid == Pid_Ping || pid == Pid_Split)
-  {
-    if (((pid == Pid_Split) && (out_size != 5)) || ((pid != Pid_Split) && (out_size != 4)))
-      error |= CAPTURE_ERROR_SIZE;
-    else if (crc5_usb(&out_data[2], out_size-2) != 0x09)
-      error |= CAPTURE_ERROR_CRC;
-  }
-  else if (pid == Pid_Data0 || pid == Pid_Data1 || pid == Pid_Data2 || pid == Pid_MData)
-  {
-    if (out_size < 4)
-      error |= CAPTURE_ERROR_SIZE;
-    else if (crc16_usb(&out_data[2], out_size-2) != 0xb001)
-      error |= CAPTURE_ERROR_CRC;
-  }
-
-  handle_folding(pid, error);
-
-  g_buffer[g_wr_ptr-2] = error | out_size;
-  g_wr_ptr += (out_size + 3) / 4;
+    g_decode_ctx.may_fold = false;
 }
 
 //-----------------------------------------------------------------------------
-static uint32_t start_time(uint32_t end_time, uint32_t size)
+static void decode_stats(void)
 {
-  if (g_buffer_info.fs)
-    return end_time - ((size * 5461) >> 16); // Divide by 12
-  else
-    return end_time - ((size * 43691) >> 16); // Divide by 1.5
+  g_buffer_info.errors = g_decode_ctx.errors;
+  g_buffer_info.resets = g_decode_ctx.resets;
+  g_buffer_info.frames = g_decode_ctx.frames;
+  g_buffer_info.folded = g_decode_ctx.folded;
 }
 
 //-----------------------------------------------------------------------------
-static void process_buffer(void)
+static void open_buffer(void)
 {
-  uint32_t time_offset = start_time(g_buffer[1], g_buffer[0]);
-  int out_count = 0;
+  g_decode_ctx.count = g_buffer_info.count;
+  g_decode_ctx.trigger_index = g_buffer_info.trigger_index;
+  g_decode_ctx.decoded = g_buffer_info.decode;
 
-  g_rd_ptr = 0;
-  g_wr_ptr = 0;
-  g_sof_index = 0;
-  g_may_fold = false;
-
-  g_buffer_info.errors = 0;
-  g_buffer_info.resets = 0;
-  g_buffer_info.frames = 0;
-  g_buffer_info.folded = 0;
-
-  for (int i = 0; i < g_buffer_info.count; i++)
+  if (!decoder_index(&g_decode_ctx))
   {
-    uint32_t size = g_buffer[g_rd_ptr];
-    uint32_t time = start_time(g_buffer[g_rd_ptr+1], size);
-
-    if (size > 0xffff)
-    {
-      display_puts("Synchronization error. Check your speed setting.\r\n");
-      out_count = 0;
-      break;
-    }
-
-    g_buffer[g_wr_ptr+1] = time - time_offset;
-    g_rd_ptr += 2;
-    g_wr_ptr += 2;
-    out_count++;
-
-    if (size == 0)
-    {
-      g_buffer[g_wr_ptr-2] = CAPTURE_RESET;
-      handle_folding(-1, 0); // Prevent folding of resets
-      g_buffer_info.resets++;
-    }
-    else if (size == 1)
-    {
-      if (g_buffer_info.fs)
-      {
-        out_count--; // Discard the packet
-        g_wr_ptr -= 2;
-      }
-      else
-      {
-        g_buffer[g_wr_ptr-2] = CAPTURE_LS_SOF;
-        handle_folding(Pid_Sof, 0); // Fold on LS SOFs
-      }
-
-      g_rd_ptr++;
-    }
-    else
-    {
-      process_packet(size-1);
-    }
+    display_puts("Synchronization error. Check your speed setting.\r\n");
+    g_buffer_info.count = 0;
   }
 
-  g_buffer_info.count = out_count;
+  decoder_open(&g_decode_ctx);
+  decode_stats();
 }
 
 //-----------------------------------------------------------------------------
@@ -396,22 +311,84 @@ static int capture_limit_value(void)
     return 5000;
   else if (g_capture_limit == CaptureLimit_10000)
     return 10000;
+  else if (g_capture_mode == CaptureMode_Streaming)
+    return 0x7fffffff;
   else
     return 100000;
 }
 
+//-----------------------------------------------------------------------------
+static int capture_pretrigger_value(void)
+{
+  if (g_capture_pretrigger == CapturePretrigger_10)
+    return 10;
+  else if (g_capture_pretrigger == CapturePretrigger_50)
+    return 50;
+  else if (g_capture_pretrigger == CapturePretrigger_90)
+    return 90;
+  else if (g_capture_pretrigger == CapturePretrigger_100)
+    return 100;
+  else
+    return 0;
+}
+
 //-----------------------------------------------------------------------------
 static int poll_cmd(void)
 {
+  int cmd = g_pending_cmd;
+
+  g_pending_cmd = 0;
+
+  if (cmd)
+    return cmd;
+
   if (SIO->FIFO_ST & SIO_FIFO_ST_VLD_Msk)
     return SIO->FIFO_RD;
   return 0;
 }
 
+//-----------------------------------------------------------------------------
+static int detect_speed(void)
+{
+  bool waiting = false;
+
+  // The idle (J) state is D+ high for FS and D- high for LS. Packets have about the same
+  // number of J and K bits, so the idle state is the one seen most of the time.
+  while (1)
+  {
+    uint32_t start = TIMER->TIMELR;
+    int dp = 0, dm = 0;
+
+    while ((TIMER->TIMELR - start) < SPEED_DETECT_TIME)
+    {
+      uint32_t v = SIO->GPIO_IN & ((1 << DP_INDEX) | (1 << DM_INDEX));
+
+      if (v == (1 << DP_INDEX))
+        dp++;
+      else if (v == (1 << DM_INDEX))
+        dm++;
+    }
+
+    if (dp > dm)
+      return CaptureSpeed_Full;
+    else if (dm > dp)
+      return CaptureSpeed_Low;
+
+    // The bus is in SE0 state, no device is connected or a bus reset is in progress
+    if (!waiting)
+      display_puts("Waiting for a device\r\n");
+
+    waiting = true;
+
+    if (poll_cmd() == 'p')
+      return -1;
+  }
+}
+
 //-----------------------------------------------------------------------------
 static bool wait_for_trigger(void)
 {
-  if (!g_buffer_info.trigger)
+  if (g_capture_trigger != CaptureTrigger_External || g_buffer_info.pretrigger)
     return true;
 
   display_puts("Waiting for a trigger\r\n");
@@ -427,128 +404,1325 @@ static bool wait_for_trigger(void)
 }
 
 //-----------------------------------------------------------------------------
-static void capture_buffer(void)
+static void dma_start(void)
 {
-  volatile uint32_t *PIO0_INSTR_MEM = (volatile uint32_t *)&PIO0->INSTR_MEM0;
-  volatile uint32_t *PIO1_INSTR_MEM = (volatile uint32_t *)&PIO1->INSTR_MEM0;
-  int index, packet;
-
-  HAL_GPIO_DP_init();
-  HAL_GPIO_DM_init();
-  HAL_GPIO_START_init();
-
-  RESETS_SET->RESET = RESETS_RESET_pio0_Msk | RESETS_RESET_pio1_Msk;
-  RESETS_CLR->RESET = RESETS_RESET_pio0_Msk | RESETS_RESET_pio1_Msk;
-  while (0 == RESETS->RESET_DONE_b.pio0 && 0 == RESETS->RESET_DONE_b.pio1);
+  RESETS_SET->RESET = RESETS_RESET_dma_Msk;
+  RESETS_CLR->RESET = RESETS_RESET_dma_Msk;
+  while (0 == RESETS->RESET_DONE_b.dma);
+
+  // Channel 1 restarts the channel 0 once it runs out of the transfer count
+  DMA->CH1_READ_ADDR   = (uint32_t)&g_dma_trans_count;
+  DMA->CH1_WRITE_ADDR  = (uint32_t)&DMA->CH0_AL1_TRANS_COUNT_TRIG;
+  DMA->CH1_TRANS_COUNT = 1;
+
+  DMA->CH1_AL1_CTRL = DMA_CH0_CTRL_TRIG_EN_Msk | (2/*word*/ << DMA_CH0_CTRL_TRIG_DATA_SIZE_Pos) |
+      (1/*self*/ << DMA_CH0_CTRL_TRIG_CHAIN_TO_Pos) |
+      (DMA_TREQ_PERMANENT << DMA_CH0_CTRL_TRIG_TREQ_SEL_Pos);
+
+  // Channels 2 and 3 do the same for the timestamps
+  DMA->CH3_READ_ADDR   = (uint32_t)&g_dma_trans_count;
+  DMA->CH3_WRITE_ADDR  = (uint32_t)&DMA->CH2_AL1_TRANS_COUNT_TRIG;
+  DMA->CH3_TRANS_COUNT = 1;
+
+  DMA->CH3_AL1_CTRL = DMA_CH0_CTRL_TRIG_EN_Msk | (2/*word*/ << DMA_CH0_CTRL_TRIG_DATA_SIZE_Pos) |
+      (3/*self*/ << DMA_CH0_CTRL_TRIG_CHAIN_TO_Pos) |
+      (DMA_TREQ_PERMANENT << DMA_CH0_CTRL_TRIG_TREQ_SEL_Pos);
+
+  DMA->CH2_READ_ADDR   = (uint32_t)&PIO1->RXF1;
+  DMA->CH2_WRITE_ADDR  = (uint32_t)g_dma_time_ring;
+  DMA->CH2_TRANS_COUNT = g_dma_trans_count;
+
+  DMA->CH2_CTRL_TRIG = DMA_CH0_CTRL_TRIG_EN_Msk | DMA_CH0_CTRL_TRIG_HIGH_PRIORITY_Msk |
+      (2/*word*/ << DMA_CH0_CTRL_TRIG_DATA_SIZE_Pos) | DMA_CH0_CTRL_TRIG_INCR_WRITE_Msk |
+      (DMA_TIME_RING_BITS << DMA_CH0_CTRL_TRIG_RING_SIZE_Pos) | DMA_CH0_CTRL_TRIG_RING_SEL_Msk |
+      (3 << DMA_CH0_CTRL_TRIG_CHAIN_TO_Pos) |
+      (DMA_DREQ_PIO1_RX1 << DMA_CH0_CTRL_TRIG_TREQ_SEL_Pos);
+
+  DMA->CH0_READ_ADDR   = (uint32_t)&PIO0->RXF0;
+  DMA->CH0_WRITE_ADDR  = (uint32_t)g_dma_ring;
+  DMA->CH0_TRANS_COUNT = g_dma_trans_count;
+
+  DMA->CH0_CTRL_TRIG = DMA_CH0_CTRL_TRIG_EN_Msk | DMA_CH0_CTRL_TRIG_HIGH_PRIORITY_Msk |
+      (2/*word*/ << DMA_CH0_CTRL_TRIG_DATA_SIZE_Pos) | DMA_CH0_CTRL_TRIG_INCR_WRITE_Msk |
+      (DMA_RING_BITS << DMA_CH0_CTRL_TRIG_RING_SIZE_Pos) | DMA_CH0_CTRL_TRIG_RING_SEL_Msk |
+      (1 << DMA_CH0_CTRL_TRIG_CHAIN_TO_Pos) |
+      (DMA_DREQ_PIO0_RX0 << DMA_CH0_CTRL_TRIG_TREQ_SEL_Pos);
+
+  g_dma_rd_ptr = 0;
+  g_dma_checked = 0;
+  g_dma_wr_base = 0;
+  g_dma_wr_left = g_dma_trans_count;
+  g_dma_time_rd_ptr = 0;
+  g_dma_time_checked = 0;
+  g_dma_time_wr_base = 0;
+  g_dma_time_wr_left = g_dma_trans_count;
+  g_dma_skip = false;
+  g_dma_resync = false;
+  g_dma_overflow = false;
+}
 
-  g_buffer_info.fs = (g_capture_speed == CaptureSpeed_Full);
-  g_buffer_info.trigger = (g_capture_trigger == CaptureTrigger_Enabled);
-  g_buffer_info.limit = capture_limit_value();
+//-----------------------------------------------------------------------------
+static void dma_stop(void)
+{
+  DMA->CHAN_ABORT = (1 << 0) | (1 << 1) | (1 << 2) | (1 << 3);
+  while (DMA->CHAN_ABORT & ((1 << 0) | (1 << 1) | (1 << 2) | (1 << 3)));
+}
 
-  static const uint16_t pio0_ops[] =
-  {
-    // idle:
-    /* 0 */  OP_MOV | MOV_DST_X | MOV_SRC_NULL | MOV_OP_INVERT,   // Reset the bit counter
-    /* 1 */  OP_WAIT | WAIT_POL_1 | WAIT_SRC_PIN | WAIT_INDEX(0), // Wait until the bus goes idle
-    /* 2 */  OP_WAIT | WAIT_POL_0 | WAIT_SRC_PIN | WAIT_INDEX(0), // Wait for the SOP
+//-----------------------------------------------------------------------------
+// Free running count of the words written by the channel. The transfer count
+// goes up only when the channel is restarted by its chained channel.
+static uint32_t dma_written(volatile uint32_t *trans_count, uint32_t *base, uint32_t *left)
+{
+  uint32_t count = *trans_count;
 
-    // start0:
-    /* 3 */  OP_NOP | OP_DELAY(1), // Skip to the middle of the bit
+  if (count > *left)
+    *base += g_dma_trans_count;
 
-    // read0:
-    /* 4 */  OP_JMP | JMP_COND_X_NZ_PD | JMP_ADDR(5/*next*/),  // Decrement the bit counter
-    /* 5 */  OP_IN  | IN_SRC_PINS | IN_CNT(1), // Sample D+
-    /* 6 */  OP_MOV | MOV_DST_OSR | MOV_SRC_PINS | MOV_OP_BIT_REV, // Sample D+ and D-
-    /* 7 */  OP_OUT | OUT_DST_Y | OUT_CNT(2),
-    /* 8 */  OP_JMP | JMP_COND_Y_ZERO | JMP_ADDR(21/*eop*/), // If both are 0, then it is an EOP
-    /* 9 */  OP_NOP | OP_DELAY(3), // Skip to the middle of the bit
-    /* 10 */ OP_JMP | JMP_COND_PIN | JMP_ADDR(4/*read0*/), // If D- is high, then D+ is low, read 0
+  *left = count;
 
-    // read1:
-    /* 11 */ OP_JMP | JMP_COND_X_NZ_PD | JMP_ADDR(12/*next*/), // Decrement the bit counter
-    /* 12 */ OP_IN  | IN_SRC_PINS | IN_CNT(1), // Sample D+
-    /* 13 */ OP_MOV | MOV_DST_OSR | MOV_SRC_PINS | MOV_OP_BIT_REV, // Sample D+ and D-
-    /* 14 */ OP_OUT | OUT_DST_Y | OUT_CNT(2),
-    /* 15 */ OP_JMP | JMP_COND_Y_ZERO | JMP_ADDR(21/*eop*/), // If both are 0, then it is an EOP
-    /* 16 */ OP_JMP | JMP_COND_PIN | JMP_ADDR(3/*start0*/),  // Look for a low to high transition on
-    /* 17 */ OP_JMP | JMP_COND_PIN | JMP_ADDR(3/*start0*/),  // D- to adjust the sample point location
-    /* 18 */ OP_JMP | JMP_COND_PIN | JMP_ADDR(3/*start0*/),
-    /* 19 */ OP_JMP | JMP_COND_PIN | JMP_ADDR(3/*start0*/),
-    /* 20 */ OP_JMP | JMP_ADDR(11/*read1*/),
+  return *base + (g_dma_trans_count - count);
+}
 
-    // eop:
-    /* 21 */ OP_PUSH, // Transfer the last data
-    /* 22 */ OP_MOV | MOV_DST_ISR | MOV_SRC_X, // Transfer the bit count
-    /* 23 */ OP_PUSH,
+//-----------------------------------------------------------------------------
+static void dma_delay(void)
+{
+  uint32_t start = TIMER->TIMELR;
 
-    // poll_reset:
-    /* 24 */ OP_SET | SET_DST_X | SET_DATA(31),
+  while ((TIMER->TIMELR - start) < 2);
+}
 
-    // poll_loop:
-    /* 25 */ OP_MOV | MOV_DST_OSR | MOV_SRC_PINS | MOV_OP_BIT_REV, // Sample D+ and D-
-    /* 26 */ OP_OUT | OUT_DST_Y | OUT_CNT(2),
-    /* 27 */ OP_JMP | JMP_COND_Y_NZ_PD | JMP_ADDR(0/*idle*/), // If either is not zero, back to idle
-    /* 28 */ OP_JMP | JMP_COND_X_NZ_PD | JMP_ADDR(25/*poll_loop*/),
-    /* 29 */ OP_MOV | MOV_DST_ISR | MOV_SRC_NULL | MOV_OP_INVERT,
-    /* 30 */ OP_PUSH,
-    // Wrap to 0 from here
+//-----------------------------------------------------------------------------
+// The words lost in the rings can't be recovered, so the reading continues from
+// the current write positions. The packet size is pushed within a few cycles of its
+// timestamp and the packets are microseconds apart, so the positions are taken
+// again until there was no packet end around the time they were taken. With dense
+// traffic there may be no such time, then everything is dropped and the positions
+// are taken again on the next call, the capture loop can still be stopped in between.
+static void dma_resync(void)
+{
+  uint32_t wr_ptr, time_wr_ptr, end;
+  bool header = true;
 
-    // Entry point, wait for a START signal from the PIO1
-    /* 31 */ OP_WAIT | WAIT_POL_1 | WAIT_SRC_PIN | WAIT_INDEX(2),
-  };
+  g_dma_overflow = true;
 
-  static const uint16_t pio1_ops[] =
+  for (int i = 0; i < DMA_RESYNC_ATTEMPTS && header; i++)
   {
-    /* 0 */  OP_NOP | OP_DELAY(31), // Wait for the PIO0 to start
-    /* 1 */  OP_NOP | OP_DELAY(31),
-    /* 2 */  OP_NOP | OP_DELAY(31),
-    /* 3 */  OP_NOP | OP_DELAY(31),
+    // The command is left for the capture loop
+    if ((g_pending_cmd = poll_cmd()))
+      return;
 
-    // wait_se0:
-    /* 4 */  OP_MOV | MOV_DST_OSR | MOV_SRC_PINS | MOV_OP_BIT_REV,
-    /* 5 */  OP_OUT | OUT_DST_Y | OUT_CNT(2),
-    /* 6 */  OP_JMP | JMP_COND_Y_NZ_PD | JMP_ADDR(4/*wait_se0*/),
+    wr_ptr = dma_written(&DMA->CH0_TRANS_COUNT, &g_dma_wr_base, &g_dma_wr_left);
+    dma_delay();
+    time_wr_ptr = dma_written(&DMA->CH2_TRANS_COUNT, &g_dma_time_wr_base, &g_dma_time_wr_left);
+    dma_delay();
+    end = dma_written(&DMA->CH0_TRANS_COUNT, &g_dma_wr_base, &g_dma_wr_left);
+    dma_delay();
 
-    /* 7 */  OP_MOV | MOV_DST_OSR | MOV_SRC_PINS | MOV_OP_BIT_REV,
-    /* 8 */  OP_OUT | OUT_DST_Y | OUT_CNT(2),
-    /* 9 */  OP_JMP | JMP_COND_Y_NZ_PD | JMP_ADDR(4/*wait_se0*/),
+    header = false;
 
-    /* 10 */ OP_MOV | MOV_DST_OSR | MOV_SRC_PINS | MOV_OP_BIT_REV,
-    /* 11 */ OP_OUT | OUT_DST_Y | OUT_CNT(2),
-    /* 12 */ OP_JMP | JMP_COND_Y_NZ_PD | JMP_ADDR(4/*wait_se0*/),
+    for (uint32_t j = wr_ptr; j != end; j++)
+      header = header || (g_dma_ring[j & (DMA_RING_SIZE-1)] & 0x80000000);
+  }
 
-    /* 13 */ OP_MOV | MOV_DST_OSR | MOV_SRC_PINS | MOV_OP_BIT_REV,
-    /* 14 */ OP_OUT | OUT_DST_Y | OUT_CNT(2),
-    /* 15 */ OP_JMP | JMP_COND_Y_NZ_PD | JMP_ADDR(4/*wait_se0*/),
+  if (header)
+    return;
 
-    /* 16 */ OP_SET | SET_DST_PINS | SET_DATA(1), // Set the START output
-    /* 17 */ OP_JMP | JMP_ADDR(17/*self*/), // Infinite loop
-  };
+  g_dma_rd_ptr = wr_ptr;
+  g_dma_checked = wr_ptr;
+  g_dma_time_rd_ptr = time_wr_ptr;
+  g_dma_time_checked = time_wr_ptr;
 
-  // PIO0 init
-  PIO0->SM0_CLKDIV = ((g_buffer_info.fs ? 1 : 8) << PIO0_SM0_CLKDIV_INT_Pos);
+  // Unless the last word was the packet size, the first packet is incomplete
+  g_dma_skip = !(g_dma_ring[(wr_ptr-1) & (DMA_RING_SIZE-1)] & 0x80000000);
+  g_dma_resync = false;
+}
 
-  for (int i = 0; i < (int)(sizeof(pio0_ops)/sizeof(uint16_t)); i++)
-    PIO0_INSTR_MEM[i] = pio0_ops[i];
+//-----------------------------------------------------------------------------
+INLINE uint32_t dma_read(void)
+{
+  return g_dma_ring[g_dma_rd_ptr++ & (DMA_RING_SIZE-1)];
+}
 
-  if (!g_buffer_info.fs)
+//-----------------------------------------------------------------------------
+INLINE uint32_t read_timestamp(void)
+{
+  // The PIO1 pushes the timestamp a few cycles after the PIO0 pushes the packet size,
+  // so it may not be available yet when the size is read
+  if (g_buffer_info.dma)
   {
-    PIO0_INSTR_MEM[1] = OP_WAIT | WAIT_POL_1 | WAIT_SRC_PIN | WAIT_INDEX(1);
-    PIO0_INSTR_MEM[2] = OP_WAIT | WAIT_POL_0 | WAIT_SRC_PIN | WAIT_INDEX(1);
-  }
+    uint32_t v;
 
-  PIO0->SM0_EXECCTRL = ((g_buffer_info.fs ? DM_INDEX : DP_INDEX) << PIO0_SM0_EXECCTRL_JMP_PIN_Pos) |
-      (30 << PIO0_SM0_EXECCTRL_WRAP_TOP_Pos) | (0 << PIO0_SM0_EXECCTRL_WRAP_BOTTOM_Pos);
+    while ((g_dma_time_rd_ptr & (DMA_TIME_RING_SIZE-1)) ==
+        ((DMA->CH2_WRITE_ADDR / sizeof(uint32_t)) & (DMA_TIME_RING_SIZE-1)));
 
-  PIO0->SM0_SHIFTCTRL = PIO0_SM0_SHIFTCTRL_FJOIN_RX_Msk | PIO0_SM0_SHIFTCTRL_AUTOPUSH_Msk |
-      (31 << PIO0_SM0_SHIFTCTRL_PUSH_THRESH_Pos);
+    v = g_dma_time_ring[g_dma_time_rd_ptr++ & (DMA_TIME_RING_SIZE-1)];
+    return ~v;
+  }
 
-  PIO0->SM0_PINCTRL = (DP_INDEX << PIO0_SM0_PINCTRL_IN_BASE_Pos);
+  while (PIO1->FSTAT & (1 << (PIO0_FSTAT_RXEMPTY_Pos + 1)));
 
-  PIO0->SM0_INSTR = OP_JMP | JMP_ADDR(31);
+  return ~PIO1->RXF1;
+}
 
-  // PIO1 init
-  PIO1->SM0_CLKDIV = ((g_buffer_info.fs ? 1 : 8) << PIO0_SM0_CLKDIV_INT_Pos);
+//-----------------------------------------------------------------------------
+// Returns the number of words available, or -1 if the ring was overrun and the packet
+// being received must be discarded. The words read since the last check were valid
+// if the channel has not written a full ring past the first of them.
+static int dma_backlog(void)
+{
+  uint32_t written = dma_written(&DMA->CH0_TRANS_COUNT, &g_dma_wr_base, &g_dma_wr_left);
+  uint32_t time_written = dma_written(&DMA->CH2_TRANS_COUNT, &g_dma_time_wr_base, &g_dma_time_wr_left);
+  int backlog;
+
+  if (g_dma_resync || (written - g_dma_checked) > DMA_RING_SIZE ||
+      (time_written - g_dma_time_checked) > DMA_TIME_RING_SIZE)
+  {
+    g_dma_resync = true;
+    dma_resync();
+    return -1;
+  }
+
+  g_dma_checked = g_dma_rd_ptr;
+  g_dma_time_checked = g_dma_time_rd_ptr;
+
+  backlog = written - g_dma_rd_ptr;
+
+  if (backlog > g_buffer_info.backlog)
+    g_buffer_info.backlog = backlog;
+
+  while (g_dma_skip && backlog > 0)
+  {
+    backlog--;
+
+    if (dma_read() & 0x80000000)
+    {
+      (void)read_timestamp();
+      g_dma_skip = false;
+    }
+  }
+
+  return backlog;
+}
+
+//-----------------------------------------------------------------------------
+// Repeats the check of dma_backlog() once the packet size and timestamp are read, before
+// the packet is stored, since the words read from the backlog may have been overwritten
+// after it was taken. After a failed check the rest of the backlog is dropped.
+static bool dma_packet_valid(void)
+{
+  uint32_t written = dma_written(&DMA->CH0_TRANS_COUNT, &g_dma_wr_base, &g_dma_wr_left);
+  uint32_t time_written = dma_written(&DMA->CH2_TRANS_COUNT, &g_dma_time_wr_base, &g_dma_time_wr_left);
+  bool valid = !g_dma_resync && (written - g_dma_checked) <= DMA_RING_SIZE &&
+      (time_written - g_dma_time_checked) <= DMA_TIME_RING_SIZE;
+
+  g_dma_checked = g_dma_rd_ptr;
+  g_dma_time_checked = g_dma_time_rd_ptr;
+
+  if (!valid)
+  {
+    g_dma_resync = true;
+    g_dma_overflow = true;
+  }
+
+  return valid;
+}
+
+//-----------------------------------------------------------------------------
+static int fold_record(int record, int end, bool sof, bool empty)
+{
+  if (!sof)
+  {
+    g_fold_packets++;
+    g_fold_empty = g_fold_empty && empty;
+    return record;
+  }
+
+  if (g_fold_sof >= 0 && g_fold_empty)
+  {
+    uint32_t sof_time = decoder_start_time(g_buffer_info.fs, g_buffer[g_fold_sof+1], g_buffer[g_fold_sof]);
+    int length = end - record;
+
+    // The frame is replaced by the run record, or merged into the existing one
+    if (g_fold_run < 0)
+    {
+      g_fold_run = g_fold_sof;
+      g_buffer[g_fold_run+0] = CAPTURE_RAW_FOLD;
+      g_buffer[g_fold_run+1] = sof_time;
+      g_buffer[g_fold_run+2] = 0;
+      g_fold_packets--;
+    }
+
+    g_buffer[g_fold_run+2]++;
+    g_buffer[g_fold_run+3] = sof_time;
+    g_buffer_info.count -= g_fold_packets;
+
+    for (int i = 0; i < length; i++)
+      g_buffer[g_fold_run+4+i] = g_buffer[record+i];
+
+    record = g_fold_run + 4;
+  }
+  else
+  {
+    g_fold_run = -1;
+  }
+
+  g_fold_sof = record;
+  g_fold_packets = 1;
+  g_fold_empty = true;
+
+  return record;
+}
+
+//-----------------------------------------------------------------------------
+// Compact records are folded before the current record is stored, the returned
+// position is where it goes
+static int fold_compact(int record, uint32_t time, bool sof, bool empty)
+{
+  if (!sof)
+  {
+    g_fold_packets++;
+    g_fold_empty = g_fold_empty && empty;
+    return record;
+  }
+
+  if (g_fold_sof >= 0 && g_fold_empty)
+  {
+    uint8_t *bytes = (uint8_t *)g_buffer;
+    uint32_t run[2];
+
+    // The SOF record is replaced by the run record with the same time
+    if (g_fold_run < 0)
+    {
+      run[0] = 0;
+      run[1] = 0;
+
+      g_fold_run = g_fold_sof;
+      g_fold_run_end = g_fold_run + decoder_compact_record(&bytes[g_fold_run], CAPTURE_FOLDED | 8,
+          g_fold_sof_delta, (uint8_t *)run);
+      g_fold_run_time = g_fold_sof_time;
+      g_fold_packets--;
+    }
+
+    memcpy(run, &bytes[g_fold_run_end - 8], sizeof(run));
+    run[0]++;
+    run[1] = g_fold_sof_time;
+    memcpy(&bytes[g_fold_run_end - 8], run, sizeof(run));
+
+    g_buffer_info.count -= g_fold_packets;
+    g_decode_prev_time = g_fold_run_time;
+    record = g_fold_run_end;
+  }
+  else
+  {
+    g_fold_run = -1;
+  }
+
+  g_fold_sof = record;
+  g_fold_sof_time = time;
+  g_fold_packets = 1;
+  g_fold_empty = true;
+
+  return record;
+}
+
+//-----------------------------------------------------------------------------
+static void fold_frames(int record, int *index, int *packet)
+{
+  uint32_t size = g_buffer[record];
+  bool sof = false;
+  bool empty = false;
+
+  if (size == 1)
+  {
+    sof = true; // LS SOF, FS packets of this size are discarded before folding
+    empty = true;
+  }
+  else if (size > 1 && size <= 0xffff)
+  {
+    int pid = decoder_raw_pid(g_buffer_info.fs, g_buffer[record+2], size-1);
+
+    sof = (pid == Pid_Sof);
+    empty = (pid == Pid_In || pid == Pid_Nak);
+  }
+
+  *packet += fold_record(record, *packet, sof, empty) - record;
+  *index = *packet + 2;
+}
+
+//-----------------------------------------------------------------------------
+// The packets are counted in the consecutive 1 ms windows, the first one starts
+// at the first stored packet
+INLINE void count_rate(uint32_t time)
+{
+  if (g_rate_count == 0 || (time - g_rate_start) >= RATE_WINDOW)
+  {
+    if (g_rate_count > g_buffer_info.peak_rate)
+      g_buffer_info.peak_rate = g_rate_count;
+
+    g_rate_start = time;
+    g_rate_count = 0;
+  }
+
+  g_rate_count++;
+}
+
+//-----------------------------------------------------------------------------
+INLINE uint32_t check_overflow(void)
+{
+  // Autopush stalls the state machine while the RX FIFO is full, the bus is not sampled
+  if ((PIO0->FDEBUG & (1 << (PIO0_FDEBUG_RXSTALL_Pos + 0))) || g_dma_overflow)
+  {
+    PIO0->FDEBUG = (1 << (PIO0_FDEBUG_RXSTALL_Pos + 0));
+    g_dma_overflow = false;
+    g_buffer_info.overflows++;
+    return CAPTURE_RAW_OVERFLOW;
+  }
+
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+INLINE bool store_word(uint32_t v, int *index, int *packet)
+{
+  if (v & 0x80000000)
+  {
+    int record = *packet;
+    uint32_t size = 0xffffffff - v;
+    uint32_t time = read_timestamp();
+    uint32_t words = *index - *packet - 2;
+
+    count_rate(time);
+
+    // The raw records are located by their sizes, so a packet that lost words in the DMA ring
+    // is dropped. There are size / 31 + 1 words for a non-zero size, none for a bus reset.
+    if (g_buffer_info.dma && (!dma_packet_valid() ||
+        (size ? ((size - (words - 1) * 31) >= 31) : (words != 0))))
+    {
+      *index = *packet + 2;
+      g_dma_overflow = true;
+      return true;
+    }
+
+    if (size == 1 && g_buffer_info.fs)
+    {
+      *index = *packet + 2; // Discard the packet, a pending overflow is marked on the next one
+      return true;
+    }
+
+    g_buffer[*packet+0] = size | check_overflow();
+    g_buffer[*packet+1] = time;
+    g_buffer_info.count++;
+    *packet = *index;
+    *index += 2;
+
+    if (g_buffer_info.fold)
+      fold_frames(record, index, packet);
+
+    if (g_buffer_info.count == g_buffer_info.limit)
+      return false;
+  }
+  else
+  {
+    if (*index < (DATA_SIZE-4)) // Reserve the space for a possible reset
+      g_buffer[(*index)++] = v;
+    else
+      return false;
+  }
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+static bool trigger_match_pattern(uint8_t *data, int size)
+{
+  for (int i = 0; i <= (size - g_trigger_pattern_size); i++)
+  {
+    int j = 0;
+
+    while (j < g_trigger_pattern_size && data[i+j] == g_trigger_pattern[j])
+      j++;
+
+    if (j == g_trigger_pattern_size)
+      return true;
+  }
+
+  return false;
+}
+
+//-----------------------------------------------------------------------------
+static bool trigger_match(uint32_t *record, int pid)
+{
+  uint8_t *data = (uint8_t *)&record[3];
+  int size = record[0] & CAPTURE_SIZE_MASK;
+
+  if (g_capture_trigger == CaptureTrigger_Reset)
+    return (record[0] & CAPTURE_RESET) ? true : false;
+
+  if (g_capture_trigger == CaptureTrigger_Error)
+    return (record[0] & CAPTURE_ERROR_MASK) ? true : false;
+
+  if (record[0] & (CAPTURE_ERROR_MASK | CAPTURE_RESET | CAPTURE_LS_SOF))
+    return false;
+
+  if (g_capture_trigger == CaptureTrigger_Setup)
+    return (pid == Pid_Setup);
+
+  if (g_capture_trigger == CaptureTrigger_Stall)
+    return (pid == Pid_Stall);
+
+  if (g_capture_trigger != CaptureTrigger_Match)
+    return false;
+
+  if (pid == Pid_In || pid == Pid_Out || pid == Pid_Setup || pid == Pid_Ping)
+  {
+    int addr = DECODER_FIELDS_ADDR(record[2]);
+    int ep = DECODER_FIELDS_EP(record[2]);
+
+    g_trigger_token = (g_trigger_address < 0 || g_trigger_address == addr) &&
+        (g_trigger_endpoint < 0 || g_trigger_endpoint == ep);
+
+    return g_trigger_token && (g_trigger_pattern_size == 0);
+  }
+  else if (pid == Pid_Data0 || pid == Pid_Data1 || pid == Pid_Data2 || pid == Pid_MData)
+  {
+    return g_trigger_token && g_trigger_pattern_size && trigger_match_pattern(&data[2], size-4);
+  }
+  else if (pid == Pid_Sof)
+  {
+    g_trigger_token = false;
+  }
+
+  return false;
+}
+
+//-----------------------------------------------------------------------------
+static int stream_decode(int ptr, uint32_t *record)
+{
+  uint32_t size = g_buffer[ptr] & ~CAPTURE_RAW_OVERFLOW;
+
+  record[2] = 0;
+
+  if (size == 0)
+  {
+    record[0] = CAPTURE_RESET;
+    return -1;
+  }
+  else if (size == 1)
+  {
+    record[0] = CAPTURE_LS_SOF;
+    return Pid_Sof;
+  }
+
+  g_decode_ctx.rd_ptr = ptr + 3;
+  return decoder_process_record(&g_decode_ctx, record, size-1);
+}
+
+//-----------------------------------------------------------------------------
+static void decode_init(void)
+{
+  g_decode_ctx.wr_ptr = 0;
+  g_decode_ctx.sof_index = 0;
+  g_decode_ctx.may_fold = false;
+
+  g_decode_ctx.errors = 0;
+  g_decode_ctx.resets = 0;
+  g_decode_ctx.frames = 0;
+  g_decode_ctx.folded = 0;
+
+  decoder_init(&g_decoder, (uint8_t *)g_buffer + DECODER_COMPACT_HEADER);
+  g_decode_held = 0;
+  g_decode_count = 0;
+  g_decode_overflow = false;
+  g_decode_sync_error = false;
+}
+
+//-----------------------------------------------------------------------------
+static void decode_discard(void)
+{
+  g_decode_held = 0;
+  g_decode_count = 0;
+  decoder_init(&g_decoder, (uint8_t *)g_buffer + g_decode_ctx.wr_ptr + DECODER_COMPACT_HEADER);
+}
+
+//-----------------------------------------------------------------------------
+// The packet is decoded past the space reserved for the header, then the compact
+// record is stored at the write position. Every DECODER_INDEX_STEP-th record stores
+// the time instead of the delta, so that the packets can be found from the index.
+static bool decode_packet(uint32_t size)
+{
+  int record = g_decode_ctx.wr_ptr;
+  uint8_t *data = (uint8_t *)g_buffer + record + DECODER_COMPACT_HEADER;
+  uint32_t time = read_timestamp();
+  uint32_t flags = 0;
+  uint32_t delta;
+  int pid = -1;
+
+  count_rate(time);
+
+  if (g_buffer_info.dma && !dma_packet_valid())
+  {
+    decode_discard(); // The overflow is marked on the next packet
+    return true;
+  }
+
+  if (check_overflow())
+    g_decode_overflow = true;
+
+  if (size > 0xffff)
+  {
+    g_decode_sync_error = true;
+    return false;
+  }
+
+  time = decoder_start_time(g_buffer_info.fs, time, size);
+
+  if (0 == g_buffer_info.count)
+    g_decode_time_offset = time;
+
+  time -= g_decode_time_offset;
+
+  if (size == 0)
+  {
+    flags = CAPTURE_RESET;
+    handle_folding(record, -1, 0); // Prevent folding of resets
+    g_decode_ctx.resets++;
+  }
+  else if (size == 1)
+  {
+    if (g_buffer_info.fs)
+    {
+      g_decode_held = 0; // Discard the packet
+      g_decode_count = 0;
+      return true;
+    }
+
+    flags = CAPTURE_LS_SOF;
+    handle_folding(record, Pid_Sof, 0); // Fold on LS SOFs
+    pid = Pid_Sof;
+  }
+  else
+  {
+    int remaining = size - 1 - 31 * (g_decode_count - g_decode_held);
+
+    // Decode the held back words, the last one is partial
+    for (int i = 0; i < g_decode_held && remaining > 0; i++)
+    {
+      uint32_t w = g_decode_words[i];
+      int bit_count = 31;
+
+      if (remaining < 31)
+      {
+        w <<= (30-remaining);
+        bit_count = remaining;
+      }
+
+      decoder_word(&g_decoder, w, bit_count);
+      remaining -= bit_count;
+    }
+
+    pid = decoder_finish(&g_decoder, &flags, g_buffer_info.fs);
+
+    if (g_decode_count != decoder_packet_words(size))
+      flags |= CAPTURE_ERROR_SIZE;
+
+    // The record must fit into the space used by the packets decoded on demand
+    if ((flags & CAPTURE_SIZE_MASK) > DECODER_MAX_DATA)
+      flags = (flags & ~CAPTURE_SIZE_MASK) | CAPTURE_ERROR_SIZE | DECODER_MAX_DATA;
+
+    handle_folding(record, pid, flags & CAPTURE_ERROR_MASK);
+  }
+
+  if (g_decode_overflow)
+  {
+    flags |= CAPTURE_OVERFLOW;
+    g_decode_ctx.may_fold = false;
+    g_decode_overflow = false;
+  }
+
+  g_buffer_info.count++;
+
+  if (g_buffer_info.fold)
+  {
+    bool valid = !(flags & (CAPTURE_ERROR_MASK | CAPTURE_OVERFLOW));
+    int moved = fold_compact(record, time, valid && (pid == Pid_Sof),
+        valid && (pid == Pid_In || pid == Pid_Nak));
+
+    if (moved != record)
+    {
+      record = moved;
+      g_decode_ctx.sof_index = moved;
+    }
+  }
+
+  delta = ((g_buffer_info.count-1) & (DECODER_INDEX_STEP-1)) ? (time - g_decode_prev_time) : time;
+  g_decode_prev_time = time;
+
+  if (record == g_fold_sof)
+    g_fold_sof_delta = delta;
+
+  g_decode_ctx.wr_ptr = record + decoder_compact_record((uint8_t *)g_buffer + record, flags, delta, data);
+
+  g_decode_held = 0;
+  g_decode_count = 0;
+  decoder_init(&g_decoder, (uint8_t *)g_buffer + g_decode_ctx.wr_ptr + DECODER_COMPACT_HEADER);
+
+  return (g_buffer_info.count != g_buffer_info.limit);
+}
+
+//-----------------------------------------------------------------------------
+INLINE bool decode_word(uint32_t v)
+{
+  if (v & 0x80000000)
+    return decode_packet(0xffffffff - v);
+
+  // Reserve the space for the held back words, the header of the packet being
+  // decoded, a possible longer run record and a possible reset
+  if ((g_decode_ctx.wr_ptr + DECODER_COMPACT_HEADER + g_decoder.size + 40) >= (DATA_SIZE * (int)sizeof(uint32_t)))
+    return false;
+
+  // The last word of a packet may be partial or even empty, so the words are
+  // decoded only once two more words have arrived
+  if (g_decode_held == 2)
+  {
+    decoder_word(&g_decoder, g_decode_words[0], 31);
+    g_decode_words[0] = g_decode_words[1];
+    g_decode_held = 1;
+  }
+
+  g_decode_words[g_decode_held++] = v;
+  g_decode_count++;
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+static void stream_flush_queue(void)
+{
+  for (int i = 0; i < g_stream_queue_size; i++)
+    display_stream_packet(g_stream_queue[i]);
+
+  g_stream_queue_size = 0;
+}
+
+//-----------------------------------------------------------------------------
+static void stream_display(uint32_t *record, int pid)
+{
+  // Frames are held back until the next SOF, so that empty frames can be folded
+  if (pid == Pid_Sof)
+  {
+    g_buffer_info.frames++;
+
+    if (g_stream_may_fold)
+    {
+      g_stream_queue[0][0] |= CAPTURE_MAY_FOLD;
+      g_buffer_info.folded++;
+    }
+
+    stream_flush_queue();
+    g_stream_may_fold = true;
+  }
+  else if (pid != Pid_In && pid != Pid_Nak)
+  {
+    g_stream_may_fold = false;
+  }
+
+  if ((record[0] & (CAPTURE_ERROR_MASK | CAPTURE_OVERFLOW | CAPTURE_TRIGGER)) ||
+      g_stream_queue_size == STREAM_FOLD_QUEUE)
+    g_stream_may_fold = false;
+
+  if (g_stream_may_fold)
+  {
+    uint32_t *entry = g_stream_queue[g_stream_queue_size++];
+
+    entry[0] = record[0];
+    entry[1] = record[1];
+    entry[2] = record[2];
+    entry[3] = record[3];
+  }
+  else
+  {
+    stream_flush_queue();
+    display_stream_packet(record);
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void stream_consume(void)
+{
+  uint32_t *record = g_packet_record;
+  int tail = g_stream_tail;
+  uint32_t size = g_buffer[tail];
+  uint32_t time;
+  int pid;
+
+  // The record is decoded into a separate buffer, so the space in the ring
+  // may be released right away
+  g_stream_tail = g_buffer[tail+2];
+
+  if (size == STREAM_WRAP)
+    return;
+
+  if (size & CAPTURE_RAW_OVERFLOW)
+  {
+    g_stream_overflow = true;
+    size &= ~CAPTURE_RAW_OVERFLOW;
+  }
+
+  time = decoder_start_time(g_buffer_info.fs, g_buffer[tail+1], size);
+
+  if (size > 0xffff)
+  {
+    if (!g_stream_sync_error)
+      display_puts("Synchronization error. Check your speed setting.\r\n");
+
+    g_stream_sync_error = true;
+    g_buffer_info.errors++;
+    set_error(true);
+    return;
+  }
+
+  if (size == 1 && g_buffer_info.fs)
+    return; // Discard the packet
+
+  pid = stream_decode(tail, record);
+
+  if (g_stream_overflow)
+  {
+    record[0] |= CAPTURE_OVERFLOW;
+    g_stream_overflow = false;
+  }
+
+  if (g_stream_trigger == -2)
+  {
+    if (!trigger_match(record, pid))
+      return;
+
+    g_stream_trigger = tail;
+    record[0] |= CAPTURE_TRIGGER;
+  }
+
+  if (0 == g_buffer_info.count++)
+    g_stream_time_offset = time;
+
+  record[1] = time - g_stream_time_offset;
+
+  if (record[0] & CAPTURE_RESET)
+  {
+    g_buffer_info.resets++;
+  }
+  else if (record[0] & CAPTURE_ERROR_MASK)
+  {
+    g_buffer_info.errors++;
+    set_error(true);
+  }
+
+  stream_display(record, pid);
+}
+
+//-----------------------------------------------------------------------------
+static int stream_limit(void)
+{
+  // Leave one word between the end and the tail, so that the full ring
+  // is not confused with the empty one
+  if (g_stream_tail > g_stream_head)
+    return g_stream_tail - 1;
+  else
+    return DATA_SIZE-3;
+}
+
+//-----------------------------------------------------------------------------
+static bool stream_has_room(void)
+{
+  int head = g_stream_end;
+  int tail = g_stream_tail;
+
+  if ((head + STREAM_MAX_RECORD) > (DATA_SIZE-3))
+    return (tail > (STREAM_MAX_RECORD + 3)) && (tail <= head);
+  else
+    return (tail <= head) || (tail > (head + STREAM_MAX_RECORD + 3));
+}
+
+//-----------------------------------------------------------------------------
+static void stream_begin_record(void)
+{
+  int head;
+
+  if (g_stream_overwrite)
+  {
+    while (g_stream_tail != g_stream_end && !stream_has_room())
+      g_stream_tail = g_buffer[g_stream_tail+2];
+  }
+
+  head = g_stream_end;
+
+  // Records never wrap, start from the beginning when there is not enough space left
+  if ((head + STREAM_MAX_RECORD) > (DATA_SIZE-3) && g_stream_tail > 0 && g_stream_tail <= head)
+  {
+    g_buffer[head] = STREAM_WRAP;
+    g_buffer[head+2] = 0;
+    g_stream_end = head = 0;
+  }
+
+  if (g_stream_trigger == -1)
+    g_stream_trigger = head;
+
+  g_stream_head = head;
+  g_stream_index = head + 3;
+  g_stream_limit = stream_limit();
+  g_stream_drop = (g_stream_index > g_stream_limit);
+}
+
+//-----------------------------------------------------------------------------
+static bool stream_store_word(uint32_t v)
+{
+  if (g_stream_index < 0)
+    stream_begin_record();
+
+  if (v & 0x80000000)
+  {
+    uint32_t time = read_timestamp(); // Consumed even for the dropped packets
+
+    count_rate(time);
+
+    if (g_buffer_info.dma && !dma_packet_valid())
+    {
+      g_stream_index = -1; // Discard the record, the overflow is marked on the next packet
+      return true;
+    }
+
+    if (g_stream_drop)
+    {
+      g_buffer_info.dropped++;
+    }
+    else
+    {
+      g_buffer[g_stream_head+0] = (0xffffffff - v) | check_overflow();
+      g_buffer[g_stream_head+1] = time;
+      g_buffer[g_stream_head+2] = g_stream_index;
+      g_stream_end = g_stream_index;
+    }
+
+    g_stream_index = -1;
+
+    if (++g_stream_count == g_buffer_info.limit)
+      return false;
+  }
+  else if (!g_stream_drop)
+  {
+    if (g_stream_index == g_stream_limit)
+    {
+      g_stream_limit = stream_limit();
+      g_stream_drop = (g_stream_index == g_stream_limit);
+    }
+
+    if (!g_stream_drop)
+      g_buffer[g_stream_index++] = v;
+  }
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+static bool stream_drain(void)
+{
+  int backlog = dma_backlog();
+
+  if (backlog < 0)
+    g_stream_index = -1; // Discard the incomplete record
+
+  for (; backlog > 0; backlog--)
+  {
+    if (!stream_store_word(dma_read()))
+      return false;
+  }
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+void capture_stream_task(void)
+{
+  if (g_streaming && !stream_drain())
+    g_streaming = false;
+}
+
+//-----------------------------------------------------------------------------
+static void stream_init(bool overwrite)
+{
+  g_stream_head  = 0;
+  g_stream_index = -1;
+  g_stream_end   = 0;
+  g_stream_tail  = 0;
+  g_stream_drop  = false;
+  g_stream_overflow = false;
+  g_stream_overwrite = overwrite;
+  g_stream_sync_error = false;
+  g_stream_queue_size = 0;
+  g_stream_count = 0;
+  g_stream_trigger = -2;
+  g_trigger_token = false;
+}
+
+//-----------------------------------------------------------------------------
+static void stream_capture(void)
+{
+  stream_init(false);
+  g_stream_may_fold = false;
+
+  // Packets are not displayed until the protocol trigger matches
+  if (!g_buffer_info.trigger || g_capture_trigger == CaptureTrigger_External)
+    g_stream_trigger = 0;
+  else
+    display_puts("Waiting for a trigger\r\n");
+
+  g_buffer_info.errors = 0;
+  g_buffer_info.resets = 0;
+  g_buffer_info.frames = 0;
+  g_buffer_info.folded = 0;
+
+  display_stream_start();
+  g_streaming = true;
+
+  while (1)
+  {
+    capture_stream_task();
+
+    if (g_stream_tail != g_stream_end)
+      stream_consume();
+    else if (!g_streaming)
+      break;
+
+    if (poll_cmd() == 'p')
+      break;
+  }
+
+  g_streaming = false;
+
+  while (g_stream_tail != g_stream_end)
+    stream_consume();
+
+  stream_flush_queue();
+}
+
+//-----------------------------------------------------------------------------
+static void reverse_buffer(int from, int to)
+{
+  for (to--; from < to; from++, to--)
+  {
+    uint32_t v = g_buffer[from];
+    g_buffer[from] = g_buffer[to];
+    g_buffer[to] = v;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static int stream_linearize(void)
+{
+  int offset = g_stream_tail;
+  int ptr = g_stream_tail;
+  int wr = 0;
+  int count = 0;
+  bool overflow = false;
+  bool trigger = false;
+
+  // Rotate the ring so that the oldest record is at the beginning
+  reverse_buffer(0, offset);
+  reverse_buffer(offset, DATA_SIZE);
+  reverse_buffer(0, DATA_SIZE);
+
+  // Compact the records into the regular capture format
+  while (ptr != g_stream_end)
+  {
+    int rd = (ptr >= offset) ? (ptr - offset) : (ptr - offset + DATA_SIZE);
+    int next = g_buffer[rd+2];
+
+    if (g_buffer[rd] != STREAM_WRAP)
+    {
+      uint32_t size = g_buffer[rd] & ~CAPTURE_RAW_OVERFLOW;
+      int words = next - ptr - 3;
+
+      overflow = overflow || (g_buffer[rd] & CAPTURE_RAW_OVERFLOW);
+      trigger = trigger || (ptr == g_stream_trigger);
+
+      // FS packets of this size are discarded, the markers are moved to the next packet
+      if (size != 1 || !g_buffer_info.fs)
+      {
+        if (trigger)
+          g_buffer_info.trigger_index = count;
+
+        g_buffer[wr+0] = size | (overflow ? CAPTURE_RAW_OVERFLOW : 0);
+        g_buffer[wr+1] = g_buffer[rd+1];
+
+        for (int i = 0; i < words; i++)
+          g_buffer[wr+2+i] = g_buffer[rd+3+i];
+
+        wr += words + 2;
+        count++;
+        overflow = false;
+        trigger = false;
+      }
+    }
+
+    ptr = next;
+  }
+
+  return count;
+}
+
+//-----------------------------------------------------------------------------
+static bool pretrigger_check(int ptr)
+{
+  uint32_t size = g_buffer[ptr] & ~CAPTURE_RAW_OVERFLOW;
+
+  if (size > 0xffff)
+    return (g_capture_trigger == CaptureTrigger_Error);
+
+  if (size == 1 && g_buffer_info.fs)
+    return false;
+
+  return trigger_match(g_packet_record, stream_decode(ptr, g_packet_record));
+}
+
+//-----------------------------------------------------------------------------
+static void pretrigger_capture(void)
+{
+  int history = capture_pretrigger_value();
+  int post_limit = ((DATA_SIZE - 2 * STREAM_MAX_RECORD) / 100) * (100 - history);
+  bool external = (g_capture_trigger == CaptureTrigger_External);
+  int post_count = 0;
+  int limit = g_buffer_info.limit;
+
+  stream_init(true);
+  g_buffer_info.limit = 0x7fffffff; // The limit only applies after the trigger
+
+  display_puts("Waiting for a trigger\r\n");
+
+  while (1)
+  {
+    if (external && g_stream_trigger == -2 && HAL_GPIO_TRIGGER_read() == 0)
+    {
+      g_stream_trigger = (g_stream_index < 0) ? -1 : g_stream_head;
+      g_buffer_info.limit = limit;
+      g_stream_count = 0;
+    }
+
+    int backlog = g_buffer_info.dma ? dma_backlog() : (0 == (PIO0->FSTAT & (1 << (PIO0_FSTAT_RXEMPTY_Pos + 0))));
+
+    if (backlog < 0)
+      g_stream_index = -1; // Discard the incomplete record
+
+    if (backlog > 0)
+    {
+      uint32_t v = g_buffer_info.dma ? dma_read() : PIO0->RXF0;
+      int end = g_stream_end;
+
+      if (!stream_store_word(v))
+        break;
+
+      if (g_stream_trigger != -2)
+      {
+        post_count += (v & 0x80000000) ? 3 : 1; // Header words expand into [size, time, next]
+      }
+      else if (!external && g_stream_end != end && pretrigger_check(g_stream_head))
+      {
+        g_stream_trigger = g_stream_head;
+        g_buffer_info.limit = limit;
+        g_stream_count = 1;
+
+        if (history == 0)
+          g_stream_tail = g_stream_head;
+      }
+
+      // Stop on the record boundary, so that the trigger record is always complete
+      if (g_stream_trigger != -2 && g_stream_end != end && post_count >= post_limit)
+        break;
+    }
+
+    if (poll_cmd() == 'p')
+      break;
+  }
+
+  g_buffer_info.count = stream_linearize();
+}
+
+//-----------------------------------------------------------------------------
+static void capture_buffer(void)
+{
+  volatile uint32_t *PIO0_INSTR_MEM = (volatile uint32_t *)&PIO0->INSTR_MEM0;
+  volatile uint32_t *PIO1_INSTR_MEM = (volatile uint32_t *)&PIO1->INSTR_MEM0;
+  int index, packet;
+  uint32_t start;
+
+  HAL_GPIO_DP_init();
+  HAL_GPIO_DM_init();
+  HAL_GPIO_START_init();
+  HAL_GPIO_STROBE_init();
+
+  RESETS_SET->RESET = RESETS_RESET_pio0_Msk | RESETS_RESET_pio1_Msk;
+  RESETS_CLR->RESET = RESETS_RESET_pio0_Msk | RESETS_RESET_pio1_Msk;
+  while (0 == RESETS->RESET_DONE_b.pio0 && 0 == RESETS->RESET_DONE_b.pio1);
+
+  if (g_capture_speed == CaptureSpeed_Auto)
+  {
+    int speed = detect_speed();
+
+    if (speed < 0)
+    {
+      display_puts("Capture stopped\r\n");
+      return;
+    }
+
+    g_buffer_info.fs = (speed == CaptureSpeed_Full);
+    display_puts(g_buffer_info.fs ? "Detected Full speed\r\n" : "Detected Low speed\r\n");
+  }
+  else
+  {
+    g_buffer_info.fs = (g_capture_speed == CaptureSpeed_Full);
+  }
+
+  g_buffer_info.trigger = (g_capture_trigger != CaptureTrigger_Disabled);
+  g_buffer_info.dma = (g_capture_mode == CaptureMode_Dma || g_capture_mode == CaptureMode_Streaming);
+  g_buffer_info.stream = (g_capture_mode == CaptureMode_Streaming);
+  g_buffer_info.pretrigger = g_buffer_info.trigger && !g_buffer_info.stream &&
+      (g_capture_pretrigger != CapturePretrigger_None || g_capture_trigger != CaptureTrigger_External);
+  g_buffer_info.fold = (g_capture_fold == CaptureFold_Enabled) && !g_buffer_info.stream &&
+      !g_buffer_info.pretrigger;
+  g_buffer_info.decode = (g_capture_decode == CaptureDecode_Enabled) && !g_buffer_info.stream &&
+      !g_buffer_info.pretrigger;
+  g_buffer_info.limit = capture_limit_value();
+
+  g_decode_ctx.buffer = g_buffer;
+  g_decode_ctx.buffer_size = DATA_SIZE;
+  g_decode_ctx.index = &g_buffer[DATA_SIZE];
+  g_decode_ctx.frame_index = &g_buffer[DATA_SIZE + INDEX_SIZE];
+  g_decode_ctx.record = g_packet_record;
+  g_decode_ctx.fs = g_buffer_info.fs;
+
+  static const uint16_t pio0_ops[] =
+  {
+    // idle:
+    /* 0 */  OP_MOV | MOV_DST_X | MOV_SRC_NULL | MOV_OP_INVERT,   // Reset the bit counter
+    /* 1 */  OP_WAIT | WAIT_POL_1 | WAIT_SRC_PIN | WAIT_INDEX(0) | OP_SIDE1_EN(0), // Wait until the bus goes idle, clear the strobe
+    /* 2 */  OP_WAIT | WAIT_POL_0 | WAIT_SRC_PIN | WAIT_INDEX(0), // Wait for the SOP
+
+    // start0:
+    /* 3 */  OP_NOP | OP_DELAY(1), // Skip to the middle of the bit
+
+    // read0:
+    /* 4 */  OP_JMP | JMP_COND_X_NZ_PD | JMP_ADDR(5/*next*/),  // Decrement the bit counter
+    /* 5 */  OP_IN  | IN_SRC_PINS | IN_CNT(1), // Sample D+
+    /* 6 */  OP_MOV | MOV_DST_OSR | MOV_SRC_PINS | MOV_OP_BIT_REV, // Sample D+ and D-
+    /* 7 */  OP_OUT | OUT_DST_Y | OUT_CNT(2),
+    /* 8 */  OP_JMP | JMP_COND_Y_ZERO | JMP_ADDR(21/*eop*/), // If both are 0, then it is an EOP
+    /* 9 */  OP_NOP | OP_DELAY(3), // Skip to the middle of the bit
+    /* 10 */ OP_JMP | JMP_COND_PIN | JMP_ADDR(4/*read0*/), // If D- is high, then D+ is low, read 0
+
+    // read1:
+    /* 11 */ OP_JMP | JMP_COND_X_NZ_PD | JMP_ADDR(12/*next*/), // Decrement the bit counter
+    /* 12 */ OP_IN  | IN_SRC_PINS | IN_CNT(1), // Sample D+
+    /* 13 */ OP_MOV | MOV_DST_OSR | MOV_SRC_PINS | MOV_OP_BIT_REV, // Sample D+ and D-
+    /* 14 */ OP_OUT | OUT_DST_Y | OUT_CNT(2),
+    /* 15 */ OP_JMP | JMP_COND_Y_ZERO | JMP_ADDR(21/*eop*/), // If both are 0, then it is an EOP
+    /* 16 */ OP_JMP | JMP_COND_PIN | JMP_ADDR(3/*start0*/),  // Look for a low to high transition on
+    /* 17 */ OP_JMP | JMP_COND_PIN | JMP_ADDR(3/*start0*/),  // D- to adjust the sample point location
+    /* 18 */ OP_JMP | JMP_COND_PIN | JMP_ADDR(3/*start0*/),
+    /* 19 */ OP_JMP | JMP_COND_PIN | JMP_ADDR(3/*start0*/),
+    /* 20 */ OP_JMP | JMP_ADDR(11/*read1*/),
+
+    // eop:
+    /* 21 */ OP_PUSH | OP_SIDE1_EN(1), // Transfer the last data, strobe the timestamp
+    /* 22 */ OP_MOV | MOV_DST_ISR | MOV_SRC_X, // Transfer the bit count
+    /* 23 */ OP_PUSH,
+
+    // poll_reset:
+    /* 24 */ OP_SET | SET_DST_X | SET_DATA(31) | OP_SIDE1_EN(0),
+
+    // poll_loop:
+    /* 25 */ OP_MOV | MOV_DST_OSR | MOV_SRC_PINS | MOV_OP_BIT_REV, // Sample D+ and D-
+    /* 26 */ OP_OUT | OUT_DST_Y | OUT_CNT(2),
+    /* 27 */ OP_JMP | JMP_COND_Y_NZ_PD | JMP_ADDR(0/*idle*/), // If either is not zero, back to idle
+    /* 28 */ OP_JMP | JMP_COND_X_NZ_PD | JMP_ADDR(25/*poll_loop*/),
+    /* 29 */ OP_MOV | MOV_DST_ISR | MOV_SRC_NULL | MOV_OP_INVERT | OP_SIDE1_EN(1),
+    /* 30 */ OP_PUSH,
+    // Wrap to 0 from here
+
+    // Entry point, wait for a START signal from the PIO1
+    /* 31 */ OP_WAIT | WAIT_POL_1 | WAIT_SRC_PIN | WAIT_INDEX(2),
+  };
+
+  static const uint16_t pio1_ops[] =
+  {
+    /* 0 */  OP_NOP | OP_DELAY(31), // Wait for the PIO0 to start
+    /* 1 */  OP_NOP | OP_DELAY(31),
+    /* 2 */  OP_NOP | OP_DELAY(31),
+    /* 3 */  OP_NOP | OP_DELAY(31),
+
+    // wait_se0:
+    /* 4 */  OP_MOV | MOV_DST_OSR | MOV_SRC_PINS | MOV_OP_BIT_REV,
+    /* 5 */  OP_OUT | OUT_DST_Y | OUT_CNT(2),
+    /* 6 */  OP_JMP | JMP_COND_Y_NZ_PD | JMP_ADDR(4/*wait_se0*/),
+
+    /* 7 */  OP_MOV | MOV_DST_OSR | MOV_SRC_PINS | MOV_OP_BIT_REV,
+    /* 8 */  OP_OUT | OUT_DST_Y | OUT_CNT(2),
+    /* 9 */  OP_JMP | JMP_COND_Y_NZ_PD | JMP_ADDR(4/*wait_se0*/),
+
+    /* 10 */ OP_MOV | MOV_DST_OSR | MOV_SRC_PINS | MOV_OP_BIT_REV,
+    /* 11 */ OP_OUT | OUT_DST_Y | OUT_CNT(2),
+    /* 12 */ OP_JMP | JMP_COND_Y_NZ_PD | JMP_ADDR(4/*wait_se0*/),
+
+    /* 13 */ OP_MOV | MOV_DST_OSR | MOV_SRC_PINS | MOV_OP_BIT_REV,
+    /* 14 */ OP_OUT | OUT_DST_Y | OUT_CNT(2),
+    /* 15 */ OP_JMP | JMP_COND_Y_NZ_PD | JMP_ADDR(4/*wait_se0*/),
+
+    /* 16 */ OP_SET | SET_DST_PINS | SET_DATA(1), // Set the START output
+    /* 17 */ OP_JMP | JMP_ADDR(17/*self*/), // Infinite loop
+
+    // Timestamp counter on the SM1, X is decremented every other cycle on all paths.
+    // Jumps on X-- always target the next instruction, so that the wrap of X is ignored.
+    // count:
+    /* 18 */ OP_JMP | JMP_COND_X_NZ_PD | JMP_ADDR(19/*next*/),
+    /* 19 */ OP_JMP | JMP_COND_PIN | JMP_ADDR(20/*strobe*/), // Wrap to 18 from here
+
+    // strobe:
+    /* 20 */ OP_IN  | IN_SRC_X | IN_CNT(32), // Autopush the timestamp
+    /* 21 */ OP_JMP | JMP_COND_X_NZ_PD | JMP_ADDR(22/*next*/),
+
+    // wait_low:
+    /* 22 */ OP_JMP | JMP_COND_X_NZ_PD | JMP_ADDR(23/*next*/),
+    /* 23 */ OP_JMP | JMP_COND_PIN | JMP_ADDR(22/*wait_low*/),
+    /* 24 */ OP_JMP | JMP_COND_X_NZ_PD | JMP_ADDR(25/*next*/),
+    /* 25 */ OP_JMP | JMP_ADDR(18/*count*/),
+  };
+
+  // PIO0 init
+  PIO0->SM0_CLKDIV = ((g_buffer_info.fs ? 1 : 8) << PIO0_SM0_CLKDIV_INT_Pos);
+
+  for (int i = 0; i < (int)(sizeof(pio0_ops)/sizeof(uint16_t)); i++)
+    PIO0_INSTR_MEM[i] = pio0_ops[i];
+
+  if (!g_buffer_info.fs)
+  {
+    PIO0_INSTR_MEM[1] = OP_WAIT | WAIT_POL_1 | WAIT_SRC_PIN | WAIT_INDEX(1) | OP_SIDE1_EN(0);
+    PIO0_INSTR_MEM[2] = OP_WAIT | WAIT_POL_0 | WAIT_SRC_PIN | WAIT_INDEX(1);
+  }
+
+  PIO0->SM0_EXECCTRL = PIO0_SM0_EXECCTRL_SIDE_EN_Msk |
+      ((g_buffer_info.fs ? DM_INDEX : DP_INDEX) << PIO0_SM0_EXECCTRL_JMP_PIN_Pos) |
+      (30 << PIO0_SM0_EXECCTRL_WRAP_TOP_Pos) | (0 << PIO0_SM0_EXECCTRL_WRAP_BOTTOM_Pos);
+
+  PIO0->SM0_SHIFTCTRL = PIO0_SM0_SHIFTCTRL_FJOIN_RX_Msk | PIO0_SM0_SHIFTCTRL_AUTOPUSH_Msk |
+      (31 << PIO0_SM0_SHIFTCTRL_PUSH_THRESH_Pos);
+
+  PIO0->SM0_PINCTRL = (DP_INDEX << PIO0_SM0_PINCTRL_IN_BASE_Pos) |
+      (2 << PIO0_SM0_PINCTRL_SIDESET_COUNT_Pos) | (STROBE_INDEX << PIO0_SM0_PINCTRL_SIDESET_BASE_Pos) |
+      (STROBE_INDEX << PIO0_SM0_PINCTRL_SET_BASE_Pos) | (1 << PIO0_SM0_PINCTRL_SET_COUNT_Pos);
+
+  PIO0->SM0_INSTR = OP_SET | SET_DST_PINDIRS | SET_DATA(1); // Clear the strobe output
+  PIO0->SM0_INSTR = OP_SET | SET_DST_PINS    | SET_DATA(0);
+  PIO0->SM0_INSTR = OP_JMP | JMP_ADDR(31);
+
+  // PIO1 init
+  PIO1->SM0_CLKDIV = ((g_buffer_info.fs ? 1 : 8) << PIO0_SM0_CLKDIV_INT_Pos);
 
   for (int i = 0; i < (int)(sizeof(pio1_ops)/sizeof(uint16_t)); i++)
     PIO1_INSTR_MEM[i] = pio1_ops[i];
@@ -561,9 +1735,30 @@ static void capture_buffer(void)
   PIO1->SM0_INSTR = OP_SET | SET_DST_PINDIRS | SET_DATA(1); // Clear the START output
   PIO1->SM0_INSTR = OP_SET | SET_DST_PINS    | SET_DATA(0);
 
+  // The timestamp counter runs at the full system clock for both speeds
+  PIO1->SM1_CLKDIV    = (1 << PIO0_SM0_CLKDIV_INT_Pos);
+  PIO1->SM1_EXECCTRL  = (STROBE_INDEX << PIO0_SM0_EXECCTRL_JMP_PIN_Pos) |
+      (19 << PIO0_SM0_EXECCTRL_WRAP_TOP_Pos) | (18 << PIO0_SM0_EXECCTRL_WRAP_BOTTOM_Pos);
+  PIO1->SM1_SHIFTCTRL = PIO0_SM0_SHIFTCTRL_FJOIN_RX_Msk | PIO0_SM0_SHIFTCTRL_AUTOPUSH_Msk |
+      (0/*32*/ << PIO0_SM0_SHIFTCTRL_PUSH_THRESH_Pos);
+  PIO1->SM1_PINCTRL   = 0;
+
+  PIO1->SM1_INSTR = OP_JMP | JMP_ADDR(18);
+
   index = 2;
   packet = 0;
+  g_fold_sof = -1;
+  g_fold_run = -1;
+  g_fold_packets = 0;
+  g_fold_empty = false;
+  decode_init();
   g_buffer_info.count = 0;
+  g_buffer_info.overflows = 0;
+  g_buffer_info.backlog = 0;
+  g_buffer_info.peak_rate = 0;
+  g_buffer_info.duration = 0;
+  g_buffer_info.dropped = 0;
+  g_buffer_info.trigger_index = -1;
 
   set_error(false);
 
@@ -575,45 +1770,461 @@ static void capture_buffer(void)
 
   display_puts("Capture started\r\n");
 
-  PIO1_SET->CTRL = (1 << (PIO0_CTRL_SM_ENABLE_Pos + 0));
+  if (g_buffer_info.dma)
+    dma_start();
+
+  start = TIMER->TIMELR;
+  g_rate_count = 0;
+
+  PIO1_SET->CTRL = (1 << (PIO0_CTRL_SM_ENABLE_Pos + 0)) | (1 << (PIO0_CTRL_SM_ENABLE_Pos + 1));
   PIO0_SET->CTRL = (1 << (PIO0_CTRL_SM_ENABLE_Pos + 0));
 
-  while (1)
+  if (g_buffer_info.stream)
+  {
+    stream_capture();
+  }
+  else if (g_buffer_info.pretrigger)
+  {
+    pretrigger_capture();
+  }
+  else if (g_buffer_info.dma)
   {
-    if (0 == (PIO0->FSTAT & (1 << (PIO0_FSTAT_RXEMPTY_Pos + 0))))
+    while (1)
     {
-      uint32_t v = PIO0->RXF0;
+      int backlog = dma_backlog();
+
+      if (backlog < 0 && g_buffer_info.decode)
+        decode_discard();
+      else if (backlog < 0)
+        index = packet + 2;
 
-      if (v & 0x80000000)
+      for (; backlog > 0; backlog--)
       {
-        g_buffer[packet+0] = 0xffffffff - v;
-        g_buffer[packet+1] = TIMER->TIMELR;
-        g_buffer_info.count++;
-        packet = index;
-        index += 2;
+        uint32_t v = dma_read();
 
-        if (g_buffer_info.count == g_buffer_info.limit)
-          break;
+        if (!(g_buffer_info.decode ? decode_word(v) : store_word(v, &index, &packet)))
+          goto done;
       }
-      else
+
+      if (poll_cmd() == 'p')
+        break;
+    }
+  }
+  else
+  {
+    while (1)
+    {
+      if (0 == (PIO0->FSTAT & (1 << (PIO0_FSTAT_RXEMPTY_Pos + 0))))
       {
-        if (index < (BUFFER_SIZE-4)) // Reserve the space for a possible reset
-          g_buffer[index++] = v;
-        else
+        uint32_t v = PIO0->RXF0;
+
+        if (!(g_buffer_info.decode ? decode_word(v) : store_word(v, &index, &packet)))
           break;
       }
-    }
 
-    if (poll_cmd() == 'p')
-      break;
+      if (poll_cmd() == 'p')
+        break;
+    }
   }
 
+done:
+  g_buffer_info.duration = TIMER->TIMELR - start;
+
+  if (g_rate_count > g_buffer_info.peak_rate)
+    g_buffer_info.peak_rate = g_rate_count;
+
+  check_overflow(); // Count the stall after the last packet, it can't be marked inline
+
+  if (g_buffer_info.dma)
+    dma_stop();
+
   display_puts("Capture stopped\r\n");
 
-  process_buffer();
+  if (g_buffer_info.stream)
+  {
+    display_stream_end();
+    g_buffer_info.count = 0; // The buffer was used as a ring, nothing to display again
+    return;
+  }
+
+  if (g_buffer_info.decode && g_decode_sync_error)
+  {
+    display_puts("Synchronization error. Check your speed setting.\r\n");
+    g_buffer_info.count = 0;
+  }
+
+  open_buffer();
   display_buffer();
 }
 
+//-----------------------------------------------------------------------------
+uint32_t *capture_packet(int index, uint32_t skip)
+{
+  uint32_t *record;
+
+  g_decode_ctx.skip = skip;
+  record = decoder_packet(&g_decode_ctx, index);
+
+  // Raw buffers are decoded on demand, the statistics are known once all of them are displayed
+  if (g_decode_ctx.counting && index == (g_decode_ctx.count - 1))
+    decode_stats();
+
+  if (record && (record[0] & CAPTURE_ERROR_MASK))
+    set_error(true);
+
+  return record;
+}
+
+//-----------------------------------------------------------------------------
+static int read_line(char *buf, int size)
+{
+  int len = 0;
+
+  while (1)
+  {
+    int c = poll_cmd();
+
+    if (c == '\r' || c == '\n')
+      break;
+    else if ((c == '\b' || c == 0x7f) && len > 0)
+      len--;
+    else if (c >= ' ' && c < 0x7f && len < (size-1))
+      buf[len++] = c;
+    else
+      continue;
+
+    display_putc(c);
+  }
+
+  buf[len] = 0;
+  display_puts("\r\n");
+
+  return len;
+}
+
+//-----------------------------------------------------------------------------
+static int parse_hex(char *str, uint8_t *out, int size)
+{
+  int count = 0;
+  int digits = 0;
+  int v = 0;
+
+  for (; *str; str++)
+  {
+    int c = *str;
+    bool separator = (c == ' ' || c == ',');
+
+    if (separator)
+    {
+      if (digits == 0)
+        continue;
+    }
+    else if (c >= '0' && c <= '9')
+    {
+      v = (v << 4) | (c - '0');
+      digits++;
+    }
+    else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+    {
+      v = (v << 4) | ((c | 0x20) - 'a' + 10);
+      digits++;
+    }
+    else
+    {
+      return -1;
+    }
+
+    if (digits == 2 || separator)
+    {
+      if (count == size)
+        return -1;
+
+      out[count++] = v;
+      digits = 0;
+      v = 0;
+    }
+  }
+
+  if (digits)
+  {
+    if (count == size)
+      return -1;
+
+    out[count++] = v;
+  }
+
+  return count;
+}
+
+//-----------------------------------------------------------------------------
+static int read_hex_value(char *name, int max)
+{
+  char buf[8];
+  uint8_t v;
+
+  display_puts(name);
+  display_puts(" (hex, empty for any): ");
+
+  if (read_line(buf, sizeof(buf)) == 0)
+    return -1;
+
+  if (parse_hex(buf, &v, 1) != 1 || v > max)
+  {
+    display_puts("Invalid value, any is used\r\n");
+    return -1;
+  }
+
+  return v;
+}
+
+//-----------------------------------------------------------------------------
+static void print_trigger_match(void)
+{
+  display_puts("address ");
+
+  if (g_trigger_address < 0)
+    display_puts("any");
+  else
+  {
+    display_puts("0x");
+    display_puthex(g_trigger_address, 2);
+  }
+
+  display_puts(", endpoint ");
+
+  if (g_trigger_endpoint < 0)
+    display_puts("any");
+  else
+    display_puthex(g_trigger_endpoint, 1);
+
+  display_puts(", data ");
+
+  if (g_trigger_pattern_size == 0)
+    display_puts("any");
+
+  for (int i = 0; i < g_trigger_pattern_size; i++)
+  {
+    display_puthex(g_trigger_pattern[i], 2);
+    display_puts(" ");
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void change_trigger_match(void)
+{
+  char buf[TRIGGER_PATTERN_SIZE * 3 + 1];
+  int size;
+
+  g_trigger_address = read_hex_value("Trigger address", 0x7f);
+  g_trigger_endpoint = read_hex_value("Trigger endpoint", 0xf);
+
+  display_puts("Trigger data pattern (up to 8 hex bytes, empty for any): ");
+  read_line(buf, sizeof(buf));
+
+  size = parse_hex(buf, g_trigger_pattern, TRIGGER_PATTERN_SIZE);
+
+  if (size < 0)
+  {
+    display_puts("Invalid pattern, any is used\r\n");
+    size = 0;
+  }
+
+  g_trigger_pattern_size = size;
+
+  display_puts("Trigger match changed to ");
+  print_trigger_match();
+  display_puts("\r\n");
+}
+
+//-----------------------------------------------------------------------------
+static void print_filter_mask(uint32_t *mask, int count, int size)
+{
+  bool any = true;
+
+  for (int i = 0; i < count; i++)
+    any = any && (mask[i / 32] & (1u << (i % 32)));
+
+  if (any)
+  {
+    display_puts("any");
+    return;
+  }
+
+  for (int i = 0; i < count; i++)
+  {
+    if (mask[i / 32] & (1u << (i % 32)))
+    {
+      display_puthex(i, size);
+      display_puts(" ");
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void print_address_filter(void)
+{
+  display_puts("address ");
+  print_filter_mask(g_display_address, 128, 2);
+  display_puts(", endpoint ");
+  print_filter_mask(&g_display_endpoint, 16, 1);
+}
+
+//-----------------------------------------------------------------------------
+static void read_filter_mask(char *name, uint32_t *mask, int count)
+{
+  char buf[FILTER_LIST_SIZE * 3 + 1];
+  uint8_t values[FILTER_LIST_SIZE];
+  int size;
+
+  display_puts(name);
+  display_puts(" (up to 16 hex values, empty for any): ");
+  read_line(buf, sizeof(buf));
+
+  size = parse_hex(buf, values, FILTER_LIST_SIZE);
+
+  for (int i = 0; i < size; i++)
+  {
+    if (values[i] >= count)
+      size = -1;
+  }
+
+  for (int i = 0; i < count; i += 32)
+    mask[i / 32] = (size > 0) ? 0 : (0xffffffff >> (32 - LIMIT(count - i, 32)));
+
+  for (int i = 0; i < size; i++)
+    mask[values[i] / 32] |= (1u << (values[i] % 32));
+
+  if (size < 0)
+    display_puts("Invalid list, any is used\r\n");
+}
+
+//-----------------------------------------------------------------------------
+static void change_address_filter(void)
+{
+  read_filter_mask("Filter addresses", g_display_address, 128);
+  read_filter_mask("Filter endpoints", &g_display_endpoint, 16);
+
+  display_puts("Address filter changed to ");
+  print_address_filter();
+  display_puts("\r\n");
+}
+
+//-----------------------------------------------------------------------------
+static int read_dec_value(char *name)
+{
+  char buf[12];
+  int len, v = 0;
+
+  display_puts(name);
+  display_puts(": ");
+
+  len = read_line(buf, sizeof(buf));
+
+  if (len == 0)
+    return -1;
+
+  for (int i = 0; i < len; i++)
+  {
+    if (buf[i] < '0' || buf[i] > '9' || v > 99999999)
+      return -2;
+
+    v = v * 10 + (buf[i] - '0');
+  }
+
+  return v;
+}
+
+//-----------------------------------------------------------------------------
+static void display_packets(void)
+{
+  int first, last;
+
+  if (g_buffer_info.count == 0)
+  {
+    display_buffer();
+    return;
+  }
+
+  first = read_dec_value("First packet");
+  last = read_dec_value("Last packet (empty for the last one)");
+
+  if (last == -1 || last > g_buffer_info.count)
+    last = g_buffer_info.count;
+
+  if (first < 1 || last < first)
+  {
+    display_puts("Invalid packet range\r\n");
+    return;
+  }
+
+  display_range(first-1, last);
+}
+
+//-----------------------------------------------------------------------------
+static void display_frames(void)
+{
+  int first, last, start, end;
+
+  if (g_buffer_info.count == 0)
+  {
+    display_buffer();
+    return;
+  }
+
+  first = read_dec_value("First frame");
+  last = read_dec_value("Last frame (empty for the first one)");
+
+  if (last == -1)
+    last = first;
+
+  if (first < 1 || last < first)
+  {
+    display_puts("Invalid frame range\r\n");
+    return;
+  }
+
+  start = decoder_frame_packet(&g_decode_ctx, first-1);
+
+  if (start < 0)
+  {
+    display_puts("Frame is not in the buffer\r\n");
+    return;
+  }
+
+  end = decoder_frame_packet(&g_decode_ctx, last);
+
+  if (end < 0)
+    end = g_buffer_info.count;
+  else if (end == start)
+    end = start + 1; // Both frames are in the same folded run
+
+  display_range(start, end);
+}
+
+//-----------------------------------------------------------------------------
+static void display_last_packets(void)
+{
+  int count;
+
+  if (g_buffer_info.count == 0)
+  {
+    display_buffer();
+    return;
+  }
+
+  count = read_dec_value("Number of packets");
+
+  if (count < 1)
+  {
+    display_puts("Invalid number of packets\r\n");
+    return;
+  }
+
+  count = LIMIT(count, g_buffer_info.count);
+
+  display_range(g_buffer_info.count - count, g_buffer_info.count);
+}
+
 //-----------------------------------------------------------------------------
 static void print_help(void)
 {
@@ -622,15 +2233,28 @@ static void print_help(void)
   display_puts("\r\n");
   display_puts("Settings:\r\n");
   display_puts("  e - Capture speed       : "); display_puts(capture_speed_str[g_capture_speed]); display_puts("\r\n");
+  display_puts("  m - Capture mode        : "); display_puts(capture_mode_str[g_capture_mode]); display_puts("\r\n");
   display_puts("  g - Capture trigger     : "); display_puts(capture_trigger_str[g_capture_trigger]); display_puts("\r\n");
+  display_puts("  k - Trigger match       : "); print_trigger_match(); display_puts("\r\n");
+  display_puts("  r - Pre-trigger history : "); display_puts(capture_pretrigger_str[g_capture_pretrigger]); display_puts("\r\n");
+  display_puts("  c - Fold at capture     : "); display_puts(capture_fold_str[g_capture_fold]); display_puts("\r\n");
+  display_puts("  d - Decode at capture   : "); display_puts(capture_decode_str[g_capture_decode]); display_puts("\r\n");
   display_puts("  l - Capture limit       : "); display_puts(capture_limit_str[g_capture_limit]); display_puts("\r\n");
   display_puts("  t - Time display format : "); display_puts(display_time_str[g_display_time]); display_puts("\r\n");
   display_puts("  a - Data display format : "); display_puts(display_data_str[g_display_data]); display_puts("\r\n");
   display_puts("  f - Fold empty frames   : "); display_puts(display_fold_str[g_display_fold]); display_puts("\r\n");
+  display_puts("  u - Packet filter       : "); display_puts(display_filter_str[g_display_filter]); display_puts("\r\n");
+  display_puts("  w - Address filter      : "); print_address_filter(); display_puts("\r\n");
+  display_puts("  i - Display view        : "); display_puts(display_view_str[g_display_view]); display_puts("\r\n");
+  display_puts("  o - Output format       : "); display_puts(display_output_str[g_display_output]); display_puts("\r\n");
   display_puts("\r\n");
   display_puts("Commands:\r\n");
   display_puts("  h - Print this help message\r\n");
   display_puts("  b - Display buffer\r\n");
+  display_puts("  n - Display packets N to M\r\n");
+  display_puts("  j - Display frames N to M\r\n");
+  display_puts("  v - Display last N packets\r\n");
+  display_puts("  x - Export buffer as pcapng\r\n");
   display_puts("  s - Start capture\r\n");
   display_puts("  p - Stop capture\r\n");
   display_puts("\r\n");
@@ -666,12 +2290,30 @@ static void core1_main(void)
       {} // Do nothing here, stop only works if the capture is running
     else if (cmd == 'b')
       display_buffer();
+    else if (cmd == 'n')
+      display_packets();
+    else if (cmd == 'j')
+      display_frames();
+    else if (cmd == 'v')
+      display_last_packets();
+    else if (cmd == 'x')
+      display_pcapng();
     else if (cmd == 'h' || cmd == '?')
       print_help();
     else if (cmd == 'e')
       change_setting("Capture speed", &g_capture_speed, CaptureSpeedCount, capture_speed_str);
+    else if (cmd == 'm')
+      change_setting("Capture mode", &g_capture_mode, CaptureModeCount, capture_mode_str);
     else if (cmd == 'g')
       change_setting("Capture trigger", &g_capture_trigger, CaptureTriggerCount, capture_trigger_str);
+    else if (cmd == 'k')
+      change_trigger_match();
+    else if (cmd == 'r')
+      change_setting("Pre-trigger history", &g_capture_pretrigger, CapturePretriggerCount, capture_pretrigger_str);
+    else if (cmd == 'c')
+      change_setting("Fold at capture", &g_capture_fold, CaptureFoldCount, capture_fold_str);
+    else if (cmd == 'd')
+      change_setting("Decode at capture", &g_capture_decode, CaptureDecodeCount, capture_decode_str);
     else if (cmd == 'l')
       change_setting("Capture limit", &g_capture_limit, CaptureLimitCount, capture_limit_str);
     else if (cmd == 't')
@@ -680,6 +2322,14 @@ static void core1_main(void)
       change_setting("Data display format", &g_display_data, DisplayDataCount, display_data_str);
     else if (cmd == 'f')
       change_setting("Fold empty frames", &g_display_fold, DisplayFoldCount, display_fold_str);
+    else if (cmd == 'u')
+      change_setting("Packet filter", &g_display_filter, DisplayFilterCount, display_filter_str);
+    else if (cmd == 'w')
+      change_address_filter();
+    else if (cmd == 'i')
+      change_setting("Display view", &g_display_view, DisplayViewCount, display_view_str);
+    else if (cmd == 'o')
+      change_setting("Output format", &g_display_output, DisplayOutputCount, display_output_str);
   }
 }
 
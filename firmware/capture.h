@@ -9,7 +9,7 @@
 #include <stdbool.h>
 
 /*- Definitions -------------------------------------------------------------*/
-#define CAPTURE_ERROR_STUFF    (1 << 31)
+#define CAPTURE_ERROR_STUFF    (1u << 31)
 #define CAPTURE_ERROR_CRC      (1 << 30)
 #define CAPTURE_ERROR_PID      (1 << 29)
 #define CAPTURE_ERROR_SYNC     (1 << 28)
@@ -18,27 +18,45 @@
 #define CAPTURE_RESET          (1 << 25)
 #define CAPTURE_LS_SOF         (1 << 24)
 #define CAPTURE_MAY_FOLD       (1 << 23)
+#define CAPTURE_TRIGGER        (1 << 22)
+#define CAPTURE_OVERFLOW       (1 << 21)
+#define CAPTURE_FOLDED         (1 << 20)
 
 #define CAPTURE_ERROR_MASK     (CAPTURE_ERROR_STUFF | CAPTURE_ERROR_CRC | \
     CAPTURE_ERROR_PID | CAPTURE_ERROR_SYNC | CAPTURE_ERROR_NBIT | CAPTURE_ERROR_SIZE)
 
 #define CAPTURE_SIZE_MASK      0xffff
 
+#define CAPTURE_TICKS_PER_US   60 // Timestamp resolution, 1/12 of the FS bit time
+
 /*- Types -------------------------------------------------------------------*/
 typedef struct
 {
   bool     fs;
   bool     trigger;
+  bool     pretrigger;
+  bool     fold;
+  bool     decode;
+  bool     dma;
+  bool     stream;
   int      limit;
   int      count;
+  int      backlog;
+  int      peak_rate; // Packets in the busiest 1 ms window
+  uint32_t duration;
   int      errors;
   int      resets;
   int      frames;
   int      folded;
+  int      dropped;
+  int      overflows;
+  int      trigger_index;
 } buffer_info_t;
 
 /*- Prototypes --------------------------------------------------------------*/
 void capture_init(void);
 void capture_command(int cmd);
+void capture_stream_task(void);
+uint32_t *capture_packet(int index, uint32_t skip);
 
 #endif // _CAPTURE_H_
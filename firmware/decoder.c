@@ -0,0 +1,1496 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2022, Alex Taradov <alex@taradov.com>. All rights reserved.
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include "capture.h"
+#include "decoder.h"
+#include "globals.h"
+#include "utils.h"
+
+/*- Constants ---------------------------------------------------------------*/
+static const uint16_t crc16_usb_tab[256] =
+{
+  0x0000, 0xc0c1, 0xc181, 0x0140, 0xc301, 0x03c0, 0x0280, 0xc241,
+  0xc601, 0x06c0, 0x0780, 0xc741, 0x0500, 0xc5c1, 0xc481, 0x0440,
+  0xcc01, 0x0cc0, 0x0d80, 0xcd41, 0x0f00, 0xcfc1, 0xce81, 0x0e40,
+  0x0a00, 0xcac1, 0xcb81, 0x0b40, 0xc901, 0x09c0, 0x0880, 0xc841,
+  0xd801, 0x18c0, 0x1980, 0xd941, 0x1b00, 0xdbc1, 0xda81, 0x1a40,
+  0x1e00, 0xdec1, 0xdf81, 0x1f40, 0xdd01, 0x1dc0, 0x1c80, 0xdc41,
+  0x1400, 0xd4c1, 0xd581, 0x1540, 0xd701, 0x17c0, 0x1680, 0xd641,
+  0xd201, 0x12c0, 0x1380, 0xd341, 0x1100, 0xd1c1, 0xd081, 0x1040,
+  0xf001, 0x30c0, 0x3180, 0xf141, 0x3300, 0xf3c1, 0xf281, 0x3240,
+  0x3600, 0xf6c1, 0xf781, 0x3740, 0xf501, 0x35c0, 0x3480, 0xf441,
+  0x3c00, 0xfcc1, 0xfd81, 0x3d40, 0xff01, 0x3fc0, 0x3e80, 0xfe41,
+  0xfa01, 0x3ac0, 0x3b80, 0xfb41, 0x3900, 0xf9c1, 0xf881, 0x3840,
+  0x2800, 0xe8c1, 0xe981, 0x2940, 0xeb01, 0x2bc0, 0x2a80, 0xea41,
+  0xee01, 0x2ec0, 0x2f80, 0xef41, 0x2d00, 0xedc1, 0xec81, 0x2c40,
+  0xe401, 0x24c0, 0x2580, 0xe541, 0x2700, 0xe7c1, 0xe681, 0x2640,
+  0x2200, 0xe2c1, 0xe381, 0x2340, 0xe101, 0x21c0, 0x2080, 0xe041,
+  0xa001, 0x60c0, 0x6180, 0xa141, 0x6300, 0xa3c1, 0xa281, 0x6240,
+  0x6600, 0xa6c1, 0xa781, 0x6740, 0xa501, 0x65c0, 0x6480, 0xa441,
+  0x6c00, 0xacc1, 0xad81, 0x6d40, 0xaf01, 0x6fc0, 0x6e80, 0xae41,
+  0xaa01, 0x6ac0, 0x6b80, 0xab41, 0x6900, 0xa9c1, 0xa881, 0x6840,
+  0x7800, 0xb8c1, 0xb981, 0x7940, 0xbb01, 0x7bc0, 0x7a80, 0xba41,
+  0xbe01, 0x7ec0, 0x7f80, 0xbf41, 0x7d00, 0xbdc1, 0xbc81, 0x7c40,
+  0xb401, 0x74c0, 0x7580, 0xb541, 0x7700, 0xb7c1, 0xb681, 0x7640,
+  0x7200, 0xb2c1, 0xb381, 0x7340, 0xb101, 0x71c0, 0x7080, 0xb041,
+  0x5000, 0x90c1, 0x9181, 0x5140, 0x9301, 0x53c0, 0x5280, 0x9241,
+  0x9601, 0x56c0, 0x5780, 0x9741, 0x5500, 0x95c1, 0x9481, 0x5440,
+  0x9c01, 0x5cc0, 0x5d80, 0x9d41, 0x5f00, 0x9fc1, 0x9e81, 0x5e40,
+  0x5a00, 0x9ac1, 0x9b81, 0x5b40, 0x9901, 0x59c0, 0x5880, 0x9841,
+  0x8801, 0x48c0, 0x4980, 0x8941, 0x4b00, 0x8bc1, 0x8a81, 0x4a40,
+  0x4e00, 0x8ec1, 0x8f81, 0x4f40, 0x8d01, 0x4dc0, 0x4c80, 0x8c41,
+  0x4400, 0x84c1, 0x8581, 0x4540, 0x8701, 0x47c0, 0x4680, 0x8641,
+  0x8201, 0x42c0, 0x4380, 0x8341, 0x4100, 0x81c1, 0x8081, 0x4040,
+};
+
+static const uint8_t crc5_usb_tab[256] =
+{
+  0x00, 0x0e, 0x1c, 0x12, 0x11, 0x1f, 0x0d, 0x03, 0x0b, 0x05, 0x17, 0x19, 0x1a, 0x14, 0x06, 0x08,
+  0x16, 0x18, 0x0a, 0x04, 0x07, 0x09, 0x1b, 0x15, 0x1d, 0x13, 0x01, 0x0f, 0x0c, 0x02, 0x10, 0x1e,
+  0x05, 0x0b, 0x19, 0x17, 0x14, 0x1a, 0x08, 0x06, 0x0e, 0x00, 0x12, 0x1c, 0x1f, 0x11, 0x03, 0x0d,
+  0x13, 0x1d, 0x0f, 0x01, 0x02, 0x0c, 0x1e, 0x10, 0x18, 0x16, 0x04, 0x0a, 0x09, 0x07, 0x15, 0x1b,
+  0x0a, 0x04, 0x16, 0x18, 0x1b, 0x15, 0x07, 0x09, 0x01, 0x0f, 0x1d, 0x13, 0x10, 0x1e, 0x0c, 0x02,
+  0x1c, 0x12, 0x00, 0x0e, 0x0d, 0x03, 0x11, 0x1f, 0x17, 0x19, 0x0b, 0x05, 0x06, 0x08, 0x1a, 0x14,
+  0x0f, 0x01, 0x13, 0x1d, 0x1e, 0x10, 0x02, 0x0c, 0x04, 0x0a, 0x18, 0x16, 0x15, 0x1b, 0x09, 0x07,
+  0x19, 0x17, 0x05, 0x0b, 0x08, 0x06, 0x14, 0x1a, 0x12, 0x1c, 0x0e, 0x00, 0x03, 0x0d, 0x1f, 0x11,
+  0x14, 0x1a, 0x08, 0x06, 0x05, 0x0b, 0x19, 0x17, 0x1f, 0x11, 0x03, 0x0d, 0x0e, 0x00, 0x12, 0x1c,
+  0x02, 0x0c, 0x1e, 0x10, 0x13, 0x1d, 0x0f, 0x01, 0x09, 0x07, 0x15, 0x1b, 0x18, 0x16, 0x04, 0x0a,
+  0x11, 0x1f, 0x0d, 0x03, 0x00, 0x0e, 0x1c, 0x12, 0x1a, 0x14, 0x06, 0x08, 0x0b, 0x05, 0x17, 0x19,
+  0x07, 0x09, 0x1b, 0x15, 0x16, 0x18, 0x0a, 0x04, 0x0c, 0x02, 0x10, 0x1e, 0x1d, 0x13, 0x01, 0x0f,
+  0x1e, 0x10, 0x02, 0x0c, 0x0f, 0x01, 0x13, 0x1d, 0x15, 0x1b, 0x09, 0x07, 0x04, 0x0a, 0x18, 0x16,
+  0x08, 0x06, 0x14, 0x1a, 0x19, 0x17, 0x05, 0x0b, 0x03, 0x0d, 0x1f, 0x11, 0x12, 0x1c, 0x0e, 0x00,
+  0x1b, 0x15, 0x07, 0x09, 0x0a, 0x04, 0x16, 0x18, 0x10, 0x1e, 0x0c, 0x02, 0x01, 0x0f, 0x1d, 0x13,
+  0x0d, 0x03, 0x11, 0x1f, 0x1c, 0x12, 0x00, 0x0e, 0x06, 0x08, 0x1a, 0x14, 0x17, 0x19, 0x0b, 0x05,
+};
+
+static const uint8_t bit_rev_tab[256] =
+{
+  0x00, 0x80, 0x40, 0xc0, 0x20, 0xa0, 0x60, 0xe0, 0x10, 0x90, 0x50, 0xd0, 0x30, 0xb0, 0x70, 0xf0,
+  0x08, 0x88, 0x48, 0xc8, 0x28, 0xa8, 0x68, 0xe8, 0x18, 0x98, 0x58, 0xd8, 0x38, 0xb8, 0x78, 0xf8,
+  0x04, 0x84, 0x44, 0xc4, 0x24, 0xa4, 0x64, 0xe4, 0x14, 0x94, 0x54, 0xd4, 0x34, 0xb4, 0x74, 0xf4,
+  0x0c, 0x8c, 0x4c, 0xcc, 0x2c, 0xac, 0x6c, 0xec, 0x1c, 0x9c, 0x5c, 0xdc, 0x3c, 0xbc, 0x7c, 0xfc,
+  0x02, 0x82, 0x42, 0xc2, 0x22, 0xa2, 0x62, 0xe2, 0x12, 0x92, 0x52, 0xd2, 0x32, 0xb2, 0x72, 0xf2,
+  0x0a, 0x8a, 0x4a, 0xca, 0x2a, 0xaa, 0x6a, 0xea, 0x1a, 0x9a, 0x5a, 0xda, 0x3a, 0xba, 0x7a, 0xfa,
+  0x06, 0x86, 0x46, 0xc6, 0x26, 0xa6, 0x66, 0xe6, 0x16, 0x96, 0x56, 0xd6, 0x36, 0xb6, 0x76, 0xf6,
+  0x0e, 0x8e, 0x4e, 0xce, 0x2e, 0xae, 0x6e, 0xee, 0x1e, 0x9e, 0x5e, 0xde, 0x3e, 0xbe, 0x7e, 0xfe,
+  0x01, 0x81, 0x41, 0xc1, 0x21, 0xa1, 0x61, 0xe1, 0x11, 0x91, 0x51, 0xd1, 0x31, 0xb1, 0x71, 0xf1,
+  0x09, 0x89, 0x49, 0xc9, 0x29, 0xa9, 0x69, 0xe9, 0x19, 0x99, 0x59, 0xd9, 0x39, 0xb9, 0x79, 0xf9,
+  0x05, 0x85, 0x45, 0xc5, 0x25, 0xa5, 0x65, 0xe5, 0x15, 0x95, 0x55, 0xd5, 0x35, 0xb5, 0x75, 0xf5,
+  0x0d, 0x8d, 0x4d, 0xcd, 0x2d, 0xad, 0x6d, 0xed, 0x1d, 0x9d, 0x5d, 0xdd, 0x3d, 0xbd, 0x7d, 0xfd,
+  0x03, 0x83, 0x43, 0xc3, 0x23, 0xa3, 0x63, 0xe3, 0x13, 0x93, 0x53, 0xd3, 0x33, 0xb3, 0x73, 0xf3,
+  0x0b, 0x8b, 0x4b, 0xcb, 0x2b, 0xab, 0x6b, 0xeb, 0x1b, 0x9b, 0x5b, 0xdb, 0x3b, 0xbb, 0x7b, 0xfb,
+  0x07, 0x87, 0x47, 0xc7, 0x27, 0xa7, 0x67, 0xe7, 0x17, 0x97, 0x57, 0xd7, 0x37, 0xb7, 0x77, 0xf7,
+  0x0f, 0x8f, 0x4f, 0xcf, 0x2f, 0xaf, 0x6f, 0xef, 0x1f, 0x9f, 0x5f, 0xdf, 0x3f, 0xbf, 0x7f, 0xff,
+};
+
+// Unstuffing of 8 decoded bits in the bus order, indexed by [ones count][bits]:
+// [7:0] - output bits, [11:8] - number of output bits, [14:12] - new ones count,
+// [15] - stuffing error
+static const uint16_t unstuff_tab[7*256] =
+{
+  0x0800, 0x0801, 0x0802, 0x0803, 0x0804, 0x0805, 0x0806, 0x0807,
+  0x0808, 0x0809, 0x080a, 0x080b, 0x080c, 0x080d, 0x080e, 0x080f,
+  0x0810, 0x0811, 0x0812, 0x0813, 0x0814, 0x0815, 0x0816, 0x0817,
+  0x0818, 0x0819, 0x081a, 0x081b, 0x081c, 0x081d, 0x081e, 0x081f,
+  0x0820, 0x0821, 0x0822, 0x0823, 0x0824, 0x0825, 0x0826, 0x0827,
+  0x0828, 0x0829, 0x082a, 0x082b, 0x082c, 0x082d, 0x082e, 0x082f,
+  0x0830, 0x0831, 0x0832, 0x0833, 0x0834, 0x0835, 0x0836, 0x0837,
+  0x0838, 0x0839, 0x083a, 0x083b, 0x083c, 0x083d, 0x083e, 0x073f,
+  0x0840, 0x0841, 0x0842, 0x0843, 0x0844, 0x0845, 0x0846, 0x0847,
+  0x0848, 0x0849, 0x084a, 0x084b, 0x084c, 0x084d, 0x084e, 0x084f,
+  0x0850, 0x0851, 0x0852, 0x0853, 0x0854, 0x0855, 0x0856, 0x0857,
+  0x0858, 0x0859, 0x085a, 0x085b, 0x085c, 0x085d, 0x085e, 0x085f,
+  0x0860, 0x0861, 0x0862, 0x0863, 0x0864, 0x0865, 0x0866, 0x0867,
+  0x0868, 0x0869, 0x086a, 0x086b, 0x086c, 0x086d, 0x086e, 0x086f,
+  0x0870, 0x0871, 0x0872, 0x0873, 0x0874, 0x0875, 0x0876, 0x0877,
+  0x0878, 0x0879, 0x087a, 0x087b, 0x087c, 0x087d, 0x077e, 0x873f,
+  0x1880, 0x1881, 0x1882, 0x1883, 0x1884, 0x1885, 0x1886, 0x1887,
+  0x1888, 0x1889, 0x188a, 0x188b, 0x188c, 0x188d, 0x188e, 0x188f,
+  0x1890, 0x1891, 0x1892, 0x1893, 0x1894, 0x1895, 0x1896, 0x1897,
+  0x1898, 0x1899, 0x189a, 0x189b, 0x189c, 0x189d, 0x189e, 0x189f,
+  0x18a0, 0x18a1, 0x18a2, 0x18a3, 0x18a4, 0x18a5, 0x18a6, 0x18a7,
+  0x18a8, 0x18a9, 0x18aa, 0x18ab, 0x18ac, 0x18ad, 0x18ae, 0x18af,
+  0x18b0, 0x18b1, 0x18b2, 0x18b3, 0x18b4, 0x18b5, 0x18b6, 0x18b7,
+  0x18b8, 0x18b9, 0x18ba, 0x18bb, 0x18bc, 0x18bd, 0x18be, 0x177f,
+  0x28c0, 0x28c1, 0x28c2, 0x28c3, 0x28c4, 0x28c5, 0x28c6, 0x28c7,
+  0x28c8, 0x28c9, 0x28ca, 0x28cb, 0x28cc, 0x28cd, 0x28ce, 0x28cf,
+  0x28d0, 0x28d1, 0x28d2, 0x28d3, 0x28d4, 0x28d5, 0x28d6, 0x28d7,
+  0x28d8, 0x28d9, 0x28da, 0x28db, 0x28dc, 0x28dd, 0x28de, 0x28df,
+  0x38e0, 0x38e1, 0x38e2, 0x38e3, 0x38e4, 0x38e5, 0x38e6, 0x38e7,
+  0x38e8, 0x38e9, 0x38ea, 0x38eb, 0x38ec, 0x38ed, 0x38ee, 0x38ef,
+  0x48f0, 0x48f1, 0x48f2, 0x48f3, 0x48f4, 0x48f5, 0x48f6, 0x48f7,
+  0x58f8, 0x58f9, 0x58fa, 0x58fb, 0x68fc, 0x68fd, 0x877e, 0x977f,
+  0x0800, 0x0801, 0x0802, 0x0803, 0x0804, 0x0805, 0x0806, 0x0807,
+  0x0808, 0x0809, 0x080a, 0x080b, 0x080c, 0x080d, 0x080e, 0x080f,
+  0x0810, 0x0811, 0x0812, 0x0813, 0x0814, 0x0815, 0x0816, 0x0817,
+  0x0818, 0x0819, 0x081a, 0x081b, 0x081c, 0x081d, 0x081e, 0x071f,
+  0x0820, 0x0821, 0x0822, 0x0823, 0x0824, 0x0825, 0x0826, 0x0827,
+  0x0828, 0x0829, 0x082a, 0x082b, 0x082c, 0x082d, 0x082e, 0x082f,
+  0x0830, 0x0831, 0x0832, 0x0833, 0x0834, 0x0835, 0x0836, 0x0837,
+  0x0838, 0x0839, 0x083a, 0x083b, 0x083c, 0x083d, 0x083e, 0x871f,
+  0x0840, 0x0841, 0x0842, 0x0843, 0x0844, 0x0845, 0x0846, 0x0847,
+  0x0848, 0x0849, 0x084a, 0x084b, 0x084c, 0x084d, 0x084e, 0x084f,
+  0x0850, 0x0851, 0x0852, 0x0853, 0x0854, 0x0855, 0x0856, 0x0857,
+  0x0858, 0x0859, 0x085a, 0x085b, 0x085c, 0x085d, 0x085e, 0x073f,
+  0x0860, 0x0861, 0x0862, 0x0863, 0x0864, 0x0865, 0x0866, 0x0867,
+  0x0868, 0x0869, 0x086a, 0x086b, 0x086c, 0x086d, 0x086e, 0x086f,
+  0x0870, 0x0871, 0x0872, 0x0873, 0x0874, 0x0875, 0x0876, 0x0877,
+  0x0878, 0x0879, 0x087a, 0x087b, 0x087c, 0x087d, 0x077e, 0x873f,
+  0x1880, 0x1881, 0x1882, 0x1883, 0x1884, 0x1885, 0x1886, 0x1887,
+  0x1888, 0x1889, 0x188a, 0x188b, 0x188c, 0x188d, 0x188e, 0x188f,
+  0x1890, 0x1891, 0x1892, 0x1893, 0x1894, 0x1895, 0x1896, 0x1897,
+  0x1898, 0x1899, 0x189a, 0x189b, 0x189c, 0x189d, 0x189e, 0x175f,
+  0x18a0, 0x18a1, 0x18a2, 0x18a3, 0x18a4, 0x18a5, 0x18a6, 0x18a7,
+  0x18a8, 0x18a9, 0x18aa, 0x18ab, 0x18ac, 0x18ad, 0x18ae, 0x18af,
+  0x18b0, 0x18b1, 0x18b2, 0x18b3, 0x18b4, 0x18b5, 0x18b6, 0x18b7,
+  0x18b8, 0x18b9, 0x18ba, 0x18bb, 0x18bc, 0x18bd, 0x18be, 0x975f,
+  0x28c0, 0x28c1, 0x28c2, 0x28c3, 0x28c4, 0x28c5, 0x28c6, 0x28c7,
+  0x28c8, 0x28c9, 0x28ca, 0x28cb, 0x28cc, 0x28cd, 0x28ce, 0x28cf,
+  0x28d0, 0x28d1, 0x28d2, 0x28d3, 0x28d4, 0x28d5, 0x28d6, 0x28d7,
+  0x28d8, 0x28d9, 0x28da, 0x28db, 0x28dc, 0x28dd, 0x28de, 0x277f,
+  0x38e0, 0x38e1, 0x38e2, 0x38e3, 0x38e4, 0x38e5, 0x38e6, 0x38e7,
+  0x38e8, 0x38e9, 0x38ea, 0x38eb, 0x38ec, 0x38ed, 0x38ee, 0x38ef,
+  0x48f0, 0x48f1, 0x48f2, 0x48f3, 0x48f4, 0x48f5, 0x48f6, 0x48f7,
+  0x58f8, 0x58f9, 0x58fa, 0x58fb, 0x68fc, 0x68fd, 0x877e, 0xa77f,
+  0x0800, 0x0801, 0x0802, 0x0803, 0x0804, 0x0805, 0x0806, 0x0807,
+  0x0808, 0x0809, 0x080a, 0x080b, 0x080c, 0x080d, 0x080e, 0x070f,
+  0x0810, 0x0811, 0x0812, 0x0813, 0x0814, 0x0815, 0x0816, 0x0817,
+  0x0818, 0x0819, 0x081a, 0x081b, 0x081c, 0x081d, 0x081e, 0x870f,
+  0x0820, 0x0821, 0x0822, 0x0823, 0x0824, 0x0825, 0x0826, 0x0827,
+  0x0828, 0x0829, 0x082a, 0x082b, 0x082c, 0x082d, 0x082e, 0x071f,
+  0x0830, 0x0831, 0x0832, 0x0833, 0x0834, 0x0835, 0x0836, 0x0837,
+  0x0838, 0x0839, 0x083a, 0x083b, 0x083c, 0x083d, 0x083e, 0x871f,
+  0x0840, 0x0841, 0x0842, 0x0843, 0x0844, 0x0845, 0x0846, 0x0847,
+  0x0848, 0x0849, 0x084a, 0x084b, 0x084c, 0x084d, 0x084e, 0x072f,
+  0x0850, 0x0851, 0x0852, 0x0853, 0x0854, 0x0855, 0x0856, 0x0857,
+  0x0858, 0x0859, 0x085a, 0x085b, 0x085c, 0x085d, 0x085e, 0x872f,
+  0x0860, 0x0861, 0x0862, 0x0863, 0x0864, 0x0865, 0x0866, 0x0867,
+  0x0868, 0x0869, 0x086a, 0x086b, 0x086c, 0x086d, 0x086e, 0x073f,
+  0x0870, 0x0871, 0x0872, 0x0873, 0x0874, 0x0875, 0x0876, 0x0877,
+  0x0878, 0x0879, 0x087a, 0x087b, 0x087c, 0x087d, 0x077e, 0x873f,
+  0x1880, 0x1881, 0x1882, 0x1883, 0x1884, 0x1885, 0x1886, 0x1887,
+  0x1888, 0x1889, 0x188a, 0x188b, 0x188c, 0x188d, 0x188e, 0x174f,
+  0x1890, 0x1891, 0x1892, 0x1893, 0x1894, 0x1895, 0x1896, 0x1897,
+  0x1898, 0x1899, 0x189a, 0x189b, 0x189c, 0x189d, 0x189e, 0x974f,
+  0x18a0, 0x18a1, 0x18a2, 0x18a3, 0x18a4, 0x18a5, 0x18a6, 0x18a7,
+  0x18a8, 0x18a9, 0x18aa, 0x18ab, 0x18ac, 0x18ad, 0x18ae, 0x175f,
+  0x18b0, 0x18b1, 0x18b2, 0x18b3, 0x18b4, 0x18b5, 0x18b6, 0x18b7,
+  0x18b8, 0x18b9, 0x18ba, 0x18bb, 0x18bc, 0x18bd, 0x18be, 0x975f,
+  0x28c0, 0x28c1, 0x28c2, 0x28c3, 0x28c4, 0x28c5, 0x28c6, 0x28c7,
+  0x28c8, 0x28c9, 0x28ca, 0x28cb, 0x28cc, 0x28cd, 0x28ce, 0x276f,
+  0x28d0, 0x28d1, 0x28d2, 0x28d3, 0x28d4, 0x28d5, 0x28d6, 0x28d7,
+  0x28d8, 0x28d9, 0x28da, 0x28db, 0x28dc, 0x28dd, 0x28de, 0xa76f,
+  0x38e0, 0x38e1, 0x38e2, 0x38e3, 0x38e4, 0x38e5, 0x38e6, 0x38e7,
+  0x38e8, 0x38e9, 0x38ea, 0x38eb, 0x38ec, 0x38ed, 0x38ee, 0x377f,
+  0x48f0, 0x48f1, 0x48f2, 0x48f3, 0x48f4, 0x48f5, 0x48f6, 0x48f7,
+  0x58f8, 0x58f9, 0x58fa, 0x58fb, 0x68fc, 0x68fd, 0x877e, 0xb77f,
+  0x0800, 0x0801, 0x0802, 0x0803, 0x0804, 0x0805, 0x0806, 0x0707,
+  0x0808, 0x0809, 0x080a, 0x080b, 0x080c, 0x080d, 0x080e, 0x8707,
+  0x0810, 0x0811, 0x0812, 0x0813, 0x0814, 0x0815, 0x0816, 0x070f,
+  0x0818, 0x0819, 0x081a, 0x081b, 0x081c, 0x081d, 0x081e, 0x870f,
+  0x0820, 0x0821, 0x0822, 0x0823, 0x0824, 0x0825, 0x0826, 0x0717,
+  0x0828, 0x0829, 0x082a, 0x082b, 0x082c, 0x082d, 0x082e, 0x8717,
+  0x0830, 0x0831, 0x0832, 0x0833, 0x0834, 0x0835, 0x0836, 0x071f,
+  0x0838, 0x0839, 0x083a, 0x083b, 0x083c, 0x083d, 0x083e, 0x871f,
+  0x0840, 0x0841, 0x0842, 0x0843, 0x0844, 0x0845, 0x0846, 0x0727,
+  0x0848, 0x0849, 0x084a, 0x084b, 0x084c, 0x084d, 0x084e, 0x8727,
+  0x0850, 0x0851, 0x0852, 0x0853, 0x0854, 0x0855, 0x0856, 0x072f,
+  0x0858, 0x0859, 0x085a, 0x085b, 0x085c, 0x085d, 0x085e, 0x872f,
+  0x0860, 0x0861, 0x0862, 0x0863, 0x0864, 0x0865, 0x0866, 0x0737,
+  0x0868, 0x0869, 0x086a, 0x086b, 0x086c, 0x086d, 0x086e, 0x8737,
+  0x0870, 0x0871, 0x0872, 0x0873, 0x0874, 0x0875, 0x0876, 0x073f,
+  0x0878, 0x0879, 0x087a, 0x087b, 0x087c, 0x087d, 0x077e, 0x873f,
+  0x1880, 0x1881, 0x1882, 0x1883, 0x1884, 0x1885, 0x1886, 0x1747,
+  0x1888, 0x1889, 0x188a, 0x188b, 0x188c, 0x188d, 0x188e, 0x9747,
+  0x1890, 0x1891, 0x1892, 0x1893, 0x1894, 0x1895, 0x1896, 0x174f,
+  0x1898, 0x1899, 0x189a, 0x189b, 0x189c, 0x189d, 0x189e, 0x974f,
+  0x18a0, 0x18a1, 0x18a2, 0x18a3, 0x18a4, 0x18a5, 0x18a6, 0x1757,
+  0x18a8, 0x18a9, 0x18aa, 0x18ab, 0x18ac, 0x18ad, 0x18ae, 0x9757,
+  0x18b0, 0x18b1, 0x18b2, 0x18b3, 0x18b4, 0x18b5, 0x18b6, 0x175f,
+  0x18b8, 0x18b9, 0x18ba, 0x18bb, 0x18bc, 0x18bd, 0x18be, 0x975f,
+  0x28c0, 0x28c1, 0x28c2, 0x28c3, 0x28c4, 0x28c5, 0x28c6, 0x2767,
+  0x28c8, 0x28c9, 0x28ca, 0x28cb, 0x28cc, 0x28cd, 0x28ce, 0xa767,
+  0x28d0, 0x28d1, 0x28d2, 0x28d3, 0x28d4, 0x28d5, 0x28d6, 0x276f,
+  0x28d8, 0x28d9, 0x28da, 0x28db, 0x28dc, 0x28dd, 0x28de, 0xa76f,
+  0x38e0, 0x38e1, 0x38e2, 0x38e3, 0x38e4, 0x38e5, 0x38e6, 0x3777,
+  0x38e8, 0x38e9, 0x38ea, 0x38eb, 0x38ec, 0x38ed, 0x38ee, 0xb777,
+  0x48f0, 0x48f1, 0x48f2, 0x48f3, 0x48f4, 0x48f5, 0x48f6, 0x477f,
+  0x58f8, 0x58f9, 0x58fa, 0x58fb, 0x68fc, 0x68fd, 0x877e, 0xc77f,
+  0x0800, 0x0801, 0x0802, 0x0703, 0x0804, 0x0805, 0x0806, 0x8703,
+  0x0808, 0x0809, 0x080a, 0x0707, 0x080c, 0x080d, 0x080e, 0x8707,
+  0x0810, 0x0811, 0x0812, 0x070b, 0x0814, 0x0815, 0x0816, 0x870b,
+  0x0818, 0x0819, 0x081a, 0x070f, 0x081c, 0x081d, 0x081e, 0x870f,
+  0x0820, 0x0821, 0x0822, 0x0713, 0x0824, 0x0825, 0x0826, 0x8713,
+  0x0828, 0x0829, 0x082a, 0x0717, 0x082c, 0x082d, 0x082e, 0x8717,
+  0x0830, 0x0831, 0x0832, 0x071b, 0x0834, 0x0835, 0x0836, 0x871b,
+  0x0838, 0x0839, 0x083a, 0x071f, 0x083c, 0x083d, 0x083e, 0x871f,
+  0x0840, 0x0841, 0x0842, 0x0723, 0x0844, 0x0845, 0x0846, 0x8723,
+  0x0848, 0x0849, 0x084a, 0x0727, 0x084c, 0x084d, 0x084e, 0x8727,
+  0x0850, 0x0851, 0x0852, 0x072b, 0x0854, 0x0855, 0x0856, 0x872b,
+  0x0858, 0x0859, 0x085a, 0x072f, 0x085c, 0x085d, 0x085e, 0x872f,
+  0x0860, 0x0861, 0x0862, 0x0733, 0x0864, 0x0865, 0x0866, 0x8733,
+  0x0868, 0x0869, 0x086a, 0x0737, 0x086c, 0x086d, 0x086e, 0x8737,
+  0x0870, 0x0871, 0x0872, 0x073b, 0x0874, 0x0875, 0x0876, 0x873b,
+  0x0878, 0x0879, 0x087a, 0x073f, 0x087c, 0x087d, 0x077e, 0x873f,
+  0x1880, 0x1881, 0x1882, 0x1743, 0x1884, 0x1885, 0x1886, 0x9743,
+  0x1888, 0x1889, 0x188a, 0x1747, 0x188c, 0x188d, 0x188e, 0x9747,
+  0x1890, 0x1891, 0x1892, 0x174b, 0x1894, 0x1895, 0x1896, 0x974b,
+  0x1898, 0x1899, 0x189a, 0x174f, 0x189c, 0x189d, 0x189e, 0x974f,
+  0x18a0, 0x18a1, 0x18a2, 0x1753, 0x18a4, 0x18a5, 0x18a6, 0x9753,
+  0x18a8, 0x18a9, 0x18aa, 0x1757, 0x18ac, 0x18ad, 0x18ae, 0x9757,
+  0x18b0, 0x18b1, 0x18b2, 0x175b, 0x18b4, 0x18b5, 0x18b6, 0x975b,
+  0x18b8, 0x18b9, 0x18ba, 0x175f, 0x18bc, 0x18bd, 0x18be, 0x975f,
+  0x28c0, 0x28c1, 0x28c2, 0x2763, 0x28c4, 0x28c5, 0x28c6, 0xa763,
+  0x28c8, 0x28c9, 0x28ca, 0x2767, 0x28cc, 0x28cd, 0x28ce, 0xa767,
+  0x28d0, 0x28d1, 0x28d2, 0x276b, 0x28d4, 0x28d5, 0x28d6, 0xa76b,
+  0x28d8, 0x28d9, 0x28da, 0x276f, 0x28dc, 0x28dd, 0x28de, 0xa76f,
+  0x38e0, 0x38e1, 0x38e2, 0x3773, 0x38e4, 0x38e5, 0x38e6, 0xb773,
+  0x38e8, 0x38e9, 0x38ea, 0x3777, 0x38ec, 0x38ed, 0x38ee, 0xb777,
+  0x48f0, 0x48f1, 0x48f2, 0x477b, 0x48f4, 0x48f5, 0x48f6, 0xc77b,
+  0x58f8, 0x58f9, 0x58fa, 0x577f, 0x68fc, 0x68fd, 0x877e, 0xd77f,
+  0x0800, 0x0701, 0x0802, 0x8701, 0x0804, 0x0703, 0x0806, 0x8703,
+  0x0808, 0x0705, 0x080a, 0x8705, 0x080c, 0x0707, 0x080e, 0x8707,
+  0x0810, 0x0709, 0x0812, 0x8709, 0x0814, 0x070b, 0x0816, 0x870b,
+  0x0818, 0x070d, 0x081a, 0x870d, 0x081c, 0x070f, 0x081e, 0x870f,
+  0x0820, 0x0711, 0x0822, 0x8711, 0x0824, 0x0713, 0x0826, 0x8713,
+  0x0828, 0x0715, 0x082a, 0x8715, 0x082c, 0x0717, 0x082e, 0x8717,
+  0x0830, 0x0719, 0x0832, 0x8719, 0x0834, 0x071b, 0x0836, 0x871b,
+  0x0838, 0x071d, 0x083a, 0x871d, 0x083c, 0x071f, 0x083e, 0x871f,
+  0x0840, 0x0721, 0x0842, 0x8721, 0x0844, 0x0723, 0x0846, 0x8723,
+  0x0848, 0x0725, 0x084a, 0x8725, 0x084c, 0x0727, 0x084e, 0x8727,
+  0x0850, 0x0729, 0x0852, 0x8729, 0x0854, 0x072b, 0x0856, 0x872b,
+  0x0858, 0x072d, 0x085a, 0x872d, 0x085c, 0x072f, 0x085e, 0x872f,
+  0x0860, 0x0731, 0x0862, 0x8731, 0x0864, 0x0733, 0x0866, 0x8733,
+  0x0868, 0x0735, 0x086a, 0x8735, 0x086c, 0x0737, 0x086e, 0x8737,
+  0x0870, 0x0739, 0x0872, 0x8739, 0x0874, 0x073b, 0x0876, 0x873b,
+  0x0878, 0x073d, 0x087a, 0x873d, 0x087c, 0x073f, 0x077e, 0x873f,
+  0x1880, 0x1741, 0x1882, 0x9741, 0x1884, 0x1743, 0x1886, 0x9743,
+  0x1888, 0x1745, 0x188a, 0x9745, 0x188c, 0x1747, 0x188e, 0x9747,
+  0x1890, 0x1749, 0x1892, 0x9749, 0x1894, 0x174b, 0x1896, 0x974b,
+  0x1898, 0x174d, 0x189a, 0x974d, 0x189c, 0x174f, 0x189e, 0x974f,
+  0x18a0, 0x1751, 0x18a2, 0x9751, 0x18a4, 0x1753, 0x18a6, 0x9753,
+  0x18a8, 0x1755, 0x18aa, 0x9755, 0x18ac, 0x1757, 0x18ae, 0x9757,
+  0x18b0, 0x1759, 0x18b2, 0x9759, 0x18b4, 0x175b, 0x18b6, 0x975b,
+  0x18b8, 0x175d, 0x18ba, 0x975d, 0x18bc, 0x175f, 0x18be, 0x975f,
+  0x28c0, 0x2761, 0x28c2, 0xa761, 0x28c4, 0x2763, 0x28c6, 0xa763,
+  0x28c8, 0x2765, 0x28ca, 0xa765, 0x28cc, 0x2767, 0x28ce, 0xa767,
+  0x28d0, 0x2769, 0x28d2, 0xa769, 0x28d4, 0x276b, 0x28d6, 0xa76b,
+  0x28d8, 0x276d, 0x28da, 0xa76d, 0x28dc, 0x276f, 0x28de, 0xa76f,
+  0x38e0, 0x3771, 0x38e2, 0xb771, 0x38e4, 0x3773, 0x38e6, 0xb773,
+  0x38e8, 0x3775, 0x38ea, 0xb775, 0x38ec, 0x3777, 0x38ee, 0xb777,
+  0x48f0, 0x4779, 0x48f2, 0xc779, 0x48f4, 0x477b, 0x48f6, 0xc77b,
+  0x58f8, 0x577d, 0x58fa, 0xd77d, 0x68fc, 0x677f, 0x877e, 0xe77f,
+  0x0700, 0x8700, 0x0701, 0x8701, 0x0702, 0x8702, 0x0703, 0x8703,
+  0x0704, 0x8704, 0x0705, 0x8705, 0x0706, 0x8706, 0x0707, 0x8707,
+  0x0708, 0x8708, 0x0709, 0x8709, 0x070a, 0x870a, 0x070b, 0x870b,
+  0x070c, 0x870c, 0x070d, 0x870d, 0x070e, 0x870e, 0x070f, 0x870f,
+  0x0710, 0x8710, 0x0711, 0x8711, 0x0712, 0x8712, 0x0713, 0x8713,
+  0x0714, 0x8714, 0x0715, 0x8715, 0x0716, 0x8716, 0x0717, 0x8717,
+  0x0718, 0x8718, 0x0719, 0x8719, 0x071a, 0x871a, 0x071b, 0x871b,
+  0x071c, 0x871c, 0x071d, 0x871d, 0x071e, 0x871e, 0x071f, 0x871f,
+  0x0720, 0x8720, 0x0721, 0x8721, 0x0722, 0x8722, 0x0723, 0x8723,
+  0x0724, 0x8724, 0x0725, 0x8725, 0x0726, 0x8726, 0x0727, 0x8727,
+  0x0728, 0x8728, 0x0729, 0x8729, 0x072a, 0x872a, 0x072b, 0x872b,
+  0x072c, 0x872c, 0x072d, 0x872d, 0x072e, 0x872e, 0x072f, 0x872f,
+  0x0730, 0x8730, 0x0731, 0x8731, 0x0732, 0x8732, 0x0733, 0x8733,
+  0x0734, 0x8734, 0x0735, 0x8735, 0x0736, 0x8736, 0x0737, 0x8737,
+  0x0738, 0x8738, 0x0739, 0x8739, 0x073a, 0x873a, 0x073b, 0x873b,
+  0x073c, 0x873c, 0x073d, 0x873d, 0x073e, 0x873e, 0x063f, 0x863f,
+  0x1740, 0x9740, 0x1741, 0x9741, 0x1742, 0x9742, 0x1743, 0x9743,
+  0x1744, 0x9744, 0x1745, 0x9745, 0x1746, 0x9746, 0x1747, 0x9747,
+  0x1748, 0x9748, 0x1749, 0x9749, 0x174a, 0x974a, 0x174b, 0x974b,
+  0x174c, 0x974c, 0x174d, 0x974d, 0x174e, 0x974e, 0x174f, 0x974f,
+  0x1750, 0x9750, 0x1751, 0x9751, 0x1752, 0x9752, 0x1753, 0x9753,
+  0x1754, 0x9754, 0x1755, 0x9755, 0x1756, 0x9756, 0x1757, 0x9757,
+  0x1758, 0x9758, 0x1759, 0x9759, 0x175a, 0x975a, 0x175b, 0x975b,
+  0x175c, 0x975c, 0x175d, 0x975d, 0x175e, 0x975e, 0x175f, 0x975f,
+  0x2760, 0xa760, 0x2761, 0xa761, 0x2762, 0xa762, 0x2763, 0xa763,
+  0x2764, 0xa764, 0x2765, 0xa765, 0x2766, 0xa766, 0x2767, 0xa767,
+  0x2768, 0xa768, 0x2769, 0xa769, 0x276a, 0xa76a, 0x276b, 0xa76b,
+  0x276c, 0xa76c, 0x276d, 0xa76d, 0x276e, 0xa76e, 0x276f, 0xa76f,
+  0x3770, 0xb770, 0x3771, 0xb771, 0x3772, 0xb772, 0x3773, 0xb773,
+  0x3774, 0xb774, 0x3775, 0xb775, 0x3776, 0xb776, 0x3777, 0xb777,
+  0x4778, 0xc778, 0x4779, 0xc779, 0x477a, 0xc77a, 0x477b, 0xc77b,
+  0x577c, 0xd77c, 0x577d, 0xd77d, 0x677e, 0xe77e, 0x863f, 0x863f,
+};
+
+/*- Implementations ---------------------------------------------------------*/
+
+//-----------------------------------------------------------------------------
+uint16_t crc16_usb(uint8_t *data, int size)
+{
+  uint16_t crc = 0xffff;
+
+  for (int i = 0; i < size; i++)
+    crc = crc16_usb_tab[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+
+  return crc;
+}
+
+//-----------------------------------------------------------------------------
+uint8_t crc5_usb(uint8_t *data, int size)
+{
+  uint8_t crc = 0xff;
+
+  for (int i = 0; i < size; i++)
+    crc = crc5_usb_tab[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+
+  return crc;
+}
+
+//-----------------------------------------------------------------------------
+void decoder_handle_folding(decoder_ctx_t *ctx, int pid, uint32_t error)
+{
+  if (error)
+    ctx->errors++;
+
+  if (pid == Pid_Sof)
+  {
+    ctx->frames++;
+
+    if (ctx->may_fold)
+    {
+      ctx->buffer[ctx->sof_index] |= CAPTURE_MAY_FOLD;
+      ctx->folded++;
+    }
+
+    ctx->sof_index = ctx->wr_ptr-2;
+    ctx->may_fold = true;
+  }
+  else if (pid != Pid_In && pid != Pid_Nak)
+  {
+    ctx->may_fold = false;
+  }
+
+  if (error)
+    ctx->may_fold = false;
+}
+
+//-----------------------------------------------------------------------------
+void decoder_init(decoder_t *dec, uint8_t *out)
+{
+  dec->out = out;
+  dec->v = 0x80000000;
+  dec->raw = 0;
+  dec->error = 0;
+  dec->size = 0;
+  dec->bit = 0;
+  dec->byte = 0;
+  dec->stuff = 0;
+  dec->raw_bits = 0;
+}
+
+//-----------------------------------------------------------------------------
+INLINE uint32_t bit_rev(uint32_t v)
+{
+  return ((uint32_t)bit_rev_tab[v & 0xff] << 24) | (bit_rev_tab[(v >> 8) & 0xff] << 16) |
+      (bit_rev_tab[(v >> 16) & 0xff] << 8) | bit_rev_tab[v >> 24];
+}
+
+//-----------------------------------------------------------------------------
+static void decoder_bits(decoder_t *dec, uint32_t x, int bit_count)
+{
+  for (int i = 0; i < bit_count; i++)
+  {
+    int bit = (x >> i) & 1;
+
+    if (dec->stuff == 6)
+    {
+      if (bit)
+        dec->error |= CAPTURE_ERROR_STUFF;
+
+      dec->stuff = 0;
+      continue;
+    }
+    else if (bit)
+      dec->stuff++;
+    else
+      dec->stuff = 0;
+
+    dec->byte |= (bit << dec->bit);
+    dec->bit++;
+
+    if (dec->bit == 8)
+    {
+      dec->out[dec->size++] = dec->byte;
+      dec->byte = 0;
+      dec->bit = 0;
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+INLINE void decoder_byte(decoder_t *dec, uint32_t x)
+{
+  uint32_t entry = unstuff_tab[(dec->stuff << 8) | x];
+
+  dec->byte |= (entry & 0xff) << dec->bit;
+  dec->bit += (entry >> 8) & 0xf;
+  dec->stuff = (entry >> 12) & 0x7;
+
+  if (entry & 0x8000)
+    dec->error |= CAPTURE_ERROR_STUFF;
+
+  if (dec->bit >= 8)
+  {
+    dec->out[dec->size++] = dec->byte;
+    dec->byte >>= 8;
+    dec->bit -= 8;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static bool decoder_fast(decoder_t *dec, uint32_t x, int bit_count)
+{
+  int stuff_count = dec->stuff;
+  int need = 6 - stuff_count;
+  int total, last;
+  uint32_t lo, hi;
+
+  // Any run of six ones inside the bits, or one continued from the previous bits, means
+  // that there may be a stuffed bit, those bits go through the unstuffing table
+  if (x & (x >> 1) & (x >> 2) & (x >> 3) & (x >> 4) & (x >> 5))
+    return false;
+
+  if (need <= bit_count && (x & ((1ul << need) - 1)) == ((1ul << need) - 1))
+    return false;
+
+  last = bit_count - 1;
+
+  while (last >= 0 && (x & (1ul << last)))
+    last--;
+
+  if (last < 0)
+    dec->stuff = stuff_count + bit_count;
+  else
+    dec->stuff = bit_count - 1 - last;
+
+  lo = dec->byte | (x << dec->bit);
+  hi = dec->bit ? (x >> (32 - dec->bit)) : 0;
+  total = dec->bit + bit_count;
+
+  while (total >= 8)
+  {
+    dec->out[dec->size++] = lo;
+    lo = (lo >> 8) | (hi << 24);
+    hi >>= 8;
+    total -= 8;
+  }
+
+  dec->byte = lo;
+  dec->bit = total;
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+void decoder_word(decoder_t *dec, uint32_t w, int bit_count)
+{
+  uint32_t v = dec->v ^ (w ^ (w << 1));
+  uint32_t x = bit_rev(~v) & ((1ul << bit_count) - 1); // Decoded bits in the bus order
+
+  dec->v = v << bit_count;
+
+  // Complete the byte left over from the previous word
+  if (dec->raw_bits)
+  {
+    int count = 8 - dec->raw_bits;
+
+    if (bit_count < count)
+    {
+      dec->raw |= (x << dec->raw_bits);
+      dec->raw_bits += bit_count;
+      return;
+    }
+
+    decoder_byte(dec, (dec->raw | (x << dec->raw_bits)) & 0xff);
+    x >>= count;
+    bit_count -= count;
+    dec->raw_bits = 0;
+  }
+
+  if (decoder_fast(dec, x, bit_count))
+    return;
+
+  while (bit_count >= 8)
+  {
+    decoder_byte(dec, x & 0xff);
+    x >>= 8;
+    bit_count -= 8;
+  }
+
+  dec->raw = x;
+  dec->raw_bits = bit_count;
+}
+
+//-----------------------------------------------------------------------------
+int decoder_finish(decoder_t *dec, uint32_t *record, bool fs)
+{
+  uint8_t *out_data = dec->out;
+  uint32_t error;
+  int out_size;
+  int pid, npid;
+
+  decoder_bits(dec, dec->raw, dec->raw_bits); // Up to 7 bits left over from the last word
+
+  error = dec->error;
+  out_size = dec->size;
+
+  if (dec->bit)
+    error |= CAPTURE_ERROR_NBIT;
+
+  if (out_size < 1)
+  {
+    record[0] = error | CAPTURE_ERROR_SIZE;
+    return -1;
+  }
+
+  if (out_data[0] != (fs ? 0x80 : 0x81))
+    error |= CAPTURE_ERROR_SYNC;
+
+  if (out_size < 2)
+  {
+    record[0] = error | CAPTURE_ERROR_SIZE | out_size;
+    return -1;
+  }
+
+  pid = out_data[1] & 0x0f;
+  npid = (~out_data[1] >> 4) & 0x0f;
+
+  if ((pid != npid) || (pid == Pid_Reserved))
+    error |= CAPTURE_ERROR_PID;
+
+  if (pid == Pid_Sof || pid == Pid_In || pid == Pid_Out || pid == Pid_Setup || pid == Pid_Ping || pid == Pid_Split)
+  {
+    if (((pid == Pid_Split) && (out_size != 5)) || ((pid != Pid_Split) && (out_size != 4)))
+      error |= CAPTURE_ERROR_SIZE;
+    else if (crc5_usb(&out_data[2], out_size-2) != 0x09)
+      error |= CAPTURE_ERROR_CRC;
+  }
+  else if (pid == Pid_Data0 || pid == Pid_Data1 || pid == Pid_Data2 || pid == Pid_MData)
+  {
+    if (out_size < 4)
+      error |= CAPTURE_ERROR_SIZE;
+    else if (crc16_usb(&out_data[2], out_size-2) != 0xb001)
+      error |= CAPTURE_ERROR_CRC;
+  }
+
+  record[0] = error | out_size;
+
+  return pid;
+}
+
+//-----------------------------------------------------------------------------
+int decoder_process_packet(decoder_ctx_t *ctx, uint32_t *record, int size)
+{
+  decoder_t dec;
+
+  decoder_init(&dec, (uint8_t *)&record[2]);
+
+  while (size)
+  {
+    uint32_t w = ctx->buffer[ctx->rd_ptr++];
+    int bit_count;
+
+    if (size < 31)
+    {
+      w <<= (30-size);
+      bit_count = size;
+    }
+    else
+    {
+      bit_count = 31;
+    }
+
+    decoder_word(&dec, w, bit_count);
+
+    size -= bit_count;
+  }
+
+  return decoder_finish(&dec, record, ctx->fs);
+}
+
+//-----------------------------------------------------------------------------
+// Token fields are kept as they are on the bus, without the CRC
+uint32_t decoder_fields(uint32_t flags, uint8_t *data)
+{
+  uint32_t pid;
+
+  // The size of the tokens is already checked
+  if (flags & (CAPTURE_ERROR_MASK | CAPTURE_RESET | CAPTURE_LS_SOF | CAPTURE_FOLDED))
+    return 0;
+
+  pid = data[1] & 0x0f;
+
+  if (pid == Pid_Sof || pid == Pid_In || pid == Pid_Out || pid == Pid_Setup || pid == Pid_Ping)
+    return DECODER_FIELDS_VALID | (pid << 24) | (((data[3] << 8) | data[2]) & 0x7ff);
+  else if (pid == Pid_Split)
+    return DECODER_FIELDS_VALID | (pid << 24) | (((data[4] << 16) | (data[3] << 8) | data[2]) & 0x7ffff);
+
+  return DECODER_FIELDS_VALID | (pid << 24);
+}
+
+//-----------------------------------------------------------------------------
+// Packet records hold the flags and the size, the time, the token fields and
+// the packet bytes. The time is filled by the caller.
+int decoder_process_record(decoder_ctx_t *ctx, uint32_t *record, int size)
+{
+  int pid = decoder_process_packet(ctx, &record[1], size);
+
+  record[0] = record[1];
+  record[2] = decoder_fields(record[0], (uint8_t *)&record[3]);
+
+  return pid;
+}
+
+//-----------------------------------------------------------------------------
+int decoder_packet_words(uint32_t size)
+{
+  // The PIO pushes the last partial word on the EOP even if it is empty
+  return (size == 0) ? 0 : (size / 31 + 1);
+}
+
+//-----------------------------------------------------------------------------
+uint32_t decoder_start_time(bool fs, uint32_t end_time, uint32_t size)
+{
+  if (fs)
+    return end_time - size * (CAPTURE_TICKS_PER_US / 12);
+  else
+    return end_time - size * (CAPTURE_TICKS_PER_US * 2 / 3);
+}
+
+//-----------------------------------------------------------------------------
+// The time from the start to the EOP, as measured by the capture, of a packet without
+// errors. The bit count is restored from the bytes with the stuffed bits and the SE0.
+uint32_t decoder_duration(bool fs, uint32_t *record)
+{
+  uint8_t *data = (uint8_t *)&record[3];
+  int bits = (record[0] & CAPTURE_SIZE_MASK) * 8;
+  uint32_t size = bits + 1;
+  int ones = 0;
+
+  for (int i = 0; i < bits; i++)
+  {
+    if (0 == (data[i / 8] & (1 << (i % 8))))
+      ones = 0;
+    else if (++ones == 6)
+    {
+      size++;
+      ones = 0;
+    }
+  }
+
+  return size * (fs ? (CAPTURE_TICKS_PER_US / 12) : (CAPTURE_TICKS_PER_US * 2 / 3));
+}
+
+//-----------------------------------------------------------------------------
+int decoder_raw_pid(bool fs, uint32_t w, int size)
+{
+  uint32_t v = 0x80000000;
+  int data = 0;
+  int pid, npid;
+
+  // SYNC and PID never need bit stuffing, so they are decoded directly from the first word
+  if (size < 16)
+    return -1;
+
+  if (size < 31)
+    w <<= (30-size);
+
+  v ^= (w ^ (w << 1));
+
+  for (int i = 0; i < 16; i++)
+  {
+    data |= ((v & 0x80000000) ? 0 : 1) << i;
+    v <<= 1;
+  }
+
+  if ((data & 0xff) != (fs ? 0x80 : 0x81))
+    return -1;
+
+  pid = (data >> 8) & 0x0f;
+  npid = (~data >> 12) & 0x0f;
+
+  return (pid == npid) ? pid : -1;
+}
+
+//-----------------------------------------------------------------------------
+bool decoder_process_buffer(decoder_ctx_t *ctx)
+{
+  uint32_t time_offset = 0;
+  bool overflow = false;
+  int out_count = 0;
+
+  ctx->rd_ptr = 0;
+  ctx->wr_ptr = 0;
+  ctx->sof_index = 0;
+  ctx->may_fold = false;
+
+  ctx->errors = 0;
+  ctx->resets = 0;
+  ctx->frames = 0;
+  ctx->folded = 0;
+
+  if (ctx->count > 0 && ctx->buffer_size >= 2)
+  {
+    uint32_t size = ctx->buffer[0] & ~CAPTURE_RAW_OVERFLOW;
+
+    time_offset = (size == CAPTURE_RAW_FOLD) ? ctx->buffer[1] :
+        decoder_start_time(ctx->fs, ctx->buffer[1], size);
+  }
+
+  for (int i = 0; i < ctx->count; i++)
+  {
+    uint32_t size, time;
+    int record = ctx->wr_ptr;
+
+    if ((ctx->rd_ptr + 2) > ctx->buffer_size)
+    {
+      ctx->count = 0;
+      return false;
+    }
+
+    size = ctx->buffer[ctx->rd_ptr] & ~CAPTURE_RAW_OVERFLOW;
+    time = decoder_start_time(ctx->fs, ctx->buffer[ctx->rd_ptr+1], size);
+
+    if (ctx->buffer[ctx->rd_ptr] & CAPTURE_RAW_OVERFLOW)
+      overflow = true;
+
+    if (size == CAPTURE_RAW_FOLD && (ctx->rd_ptr + 4) <= ctx->buffer_size)
+    {
+      uint32_t count = ctx->buffer[ctx->rd_ptr+2];
+
+      ctx->buffer[ctx->wr_ptr+0] = CAPTURE_FOLDED | 8;
+      ctx->buffer[ctx->wr_ptr+1] = ctx->buffer[ctx->rd_ptr+1] - time_offset;
+      ctx->buffer[ctx->wr_ptr+2] = count;
+      ctx->buffer[ctx->wr_ptr+3] = ctx->buffer[ctx->rd_ptr+3] - time_offset;
+      ctx->rd_ptr += 4;
+      ctx->wr_ptr += 4;
+      out_count++;
+
+      ctx->frames += count;
+      ctx->folded += count;
+      ctx->may_fold = false;
+      continue;
+    }
+
+    if (size > 0xffff || (ctx->rd_ptr + 2 + decoder_packet_words(size)) > ctx->buffer_size)
+    {
+      ctx->count = 0;
+      return false;
+    }
+
+    ctx->buffer[ctx->wr_ptr+1] = time - time_offset;
+    ctx->rd_ptr += 2;
+    ctx->wr_ptr += 2;
+    out_count++;
+
+    if (size == 0)
+    {
+      ctx->buffer[ctx->wr_ptr-2] = CAPTURE_RESET;
+      decoder_handle_folding(ctx, -1, 0); // Prevent folding of resets
+      ctx->resets++;
+    }
+    else if (size == 1)
+    {
+      if (ctx->fs)
+      {
+        out_count--; // Discard the packet
+        ctx->wr_ptr -= 2;
+
+        if (i == ctx->trigger_index)
+          ctx->trigger_index++;
+      }
+      else
+      {
+        ctx->buffer[ctx->wr_ptr-2] = CAPTURE_LS_SOF;
+        decoder_handle_folding(ctx, Pid_Sof, 0); // Fold on LS SOFs
+      }
+
+      ctx->rd_ptr++;
+    }
+    else
+    {
+      int data = ctx->rd_ptr;
+      int pid = decoder_process_packet(ctx, &ctx->buffer[record], size-1);
+
+      ctx->rd_ptr = data + decoder_packet_words(size);
+
+      decoder_handle_folding(ctx, pid, ctx->buffer[record] & CAPTURE_ERROR_MASK);
+      ctx->wr_ptr += ((ctx->buffer[record] & CAPTURE_SIZE_MASK) + 3) / 4;
+    }
+
+    // The markers are moved to the next packet if this one was discarded
+    if (overflow && ctx->wr_ptr > record)
+    {
+      ctx->buffer[record] |= CAPTURE_OVERFLOW;
+      ctx->may_fold = false;
+      overflow = false;
+    }
+
+    if (i == ctx->trigger_index)
+    {
+      ctx->buffer[record] |= CAPTURE_TRIGGER;
+      ctx->may_fold = false;
+    }
+  }
+
+  ctx->count = out_count;
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+static uint8_t *put_varint(uint8_t *out, uint32_t v)
+{
+  while (v >= 0x80)
+  {
+    *out++ = v | 0x80;
+    v >>= 7;
+  }
+
+  *out++ = v;
+
+  return out;
+}
+
+//-----------------------------------------------------------------------------
+static int get_varint(uint8_t *data, int size, uint32_t *v)
+{
+  uint32_t value = 0;
+
+  for (int i = 0; i < size && i < 5; i++)
+  {
+    value |= (uint32_t)(data[i] & 0x7f) << (7 * i);
+
+    if (0 == (data[i] & 0x80))
+    {
+      *v = value;
+      return i + 1;
+    }
+  }
+
+  return -1;
+}
+
+//-----------------------------------------------------------------------------
+INLINE bool compact_sync_omitted(uint32_t flags)
+{
+  // The SYNC byte is only stored if it did not match
+  return (flags & CAPTURE_SIZE_MASK) &&
+      0 == (flags & (CAPTURE_ERROR_SYNC | CAPTURE_FOLDED | CAPTURE_RESET | CAPTURE_LS_SOF));
+}
+
+//-----------------------------------------------------------------------------
+// Returns the number of the packet bytes stored after the compact header
+int decoder_compact_size(uint32_t flags)
+{
+  return (flags & CAPTURE_SIZE_MASK) - (compact_sync_omitted(flags) ? 1 : 0);
+}
+
+//-----------------------------------------------------------------------------
+// Compact record: the first byte holds the size (63 if it is continued in a varint),
+// CAPTURE_MAY_FOLD and the presence of the other flags. It is followed by the varint
+// flags, the rest of the size, the varint time delta from the previous record and
+// the data bytes. Every DECODER_INDEX_STEP-th record stores the time instead of the delta.
+int decoder_compact_header(uint8_t *out, uint32_t flags, uint32_t delta)
+{
+  uint32_t ext = (flags & ~(CAPTURE_MAY_FOLD | CAPTURE_SIZE_MASK)) >> 20;
+  int size = flags & CAPTURE_SIZE_MASK;
+  uint8_t *ptr = &out[1];
+
+  out[0] = LIMIT(size, 63) | ((flags & CAPTURE_MAY_FOLD) ? DECODER_COMPACT_MAY_FOLD : 0) |
+      (ext ? 0x80 : 0);
+
+  if (ext)
+    ptr = put_varint(ptr, ext);
+
+  if (size >= 63)
+    ptr = put_varint(ptr, size - 63);
+
+  ptr = put_varint(ptr, delta);
+
+  return ptr - out;
+}
+
+//-----------------------------------------------------------------------------
+int decoder_compact_record(uint8_t *out, uint32_t flags, uint32_t delta, uint8_t *data)
+{
+  uint8_t header[DECODER_COMPACT_HEADER];
+  int length = decoder_compact_header(header, flags, delta);
+  int size = decoder_compact_size(flags);
+
+  if (compact_sync_omitted(flags))
+    data++;
+
+  // The data may overlap the output
+  memmove(&out[length], data, size);
+
+  for (int i = 0; i < length; i++)
+    out[i] = header[i];
+
+  return length + size;
+}
+
+//-----------------------------------------------------------------------------
+static int compact_header(uint8_t *data, int size, uint32_t *flags, uint32_t *delta)
+{
+  uint32_t ext = 0;
+  uint32_t length;
+  int ptr = 1;
+  int n;
+
+  if (size < 1)
+    return -1;
+
+  length = data[0] & 0x3f;
+
+  if (data[0] & 0x80)
+  {
+    if ((n = get_varint(&data[ptr], size - ptr, &ext)) < 0)
+      return -1;
+
+    ptr += n;
+  }
+
+  if (length == 63)
+  {
+    uint32_t extra;
+
+    if ((n = get_varint(&data[ptr], size - ptr, &extra)) < 0 || extra > (CAPTURE_SIZE_MASK - 63))
+      return -1;
+
+    length += extra;
+    ptr += n;
+  }
+
+  if ((n = get_varint(&data[ptr], size - ptr, delta)) < 0)
+    return -1;
+
+  *flags = (ext << 20) | length | ((data[0] & DECODER_COMPACT_MAY_FOLD) ? CAPTURE_MAY_FOLD : 0);
+
+  // The run record holds the number of frames and the time of the last one
+  if ((*flags & CAPTURE_FOLDED) && length != 8)
+    return -1;
+
+  return ptr + n;
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t compact_time(decoder_ctx_t *ctx, int index, int ptr)
+{
+  uint32_t flags, delta;
+
+  compact_header((uint8_t *)ctx->buffer + ptr, DECODER_COMPACT_HEADER, &flags, &delta);
+
+  return (index & (DECODER_INDEX_STEP-1)) ? (ctx->time + delta) : delta;
+}
+
+//-----------------------------------------------------------------------------
+static int record_length(decoder_ctx_t *ctx, int ptr)
+{
+  uint32_t size;
+
+  if (ctx->decoded)
+  {
+    int avail = ctx->buffer_size * (int)sizeof(uint32_t) - ptr;
+    uint32_t flags, delta;
+    int header = compact_header((uint8_t *)ctx->buffer + ptr, LIMIT(avail, DECODER_COMPACT_HEADER),
+        &flags, &delta);
+
+    return (header < 0) ? -1 : (header + decoder_compact_size(flags));
+  }
+
+  size = ctx->buffer[ptr] & ~CAPTURE_RAW_OVERFLOW;
+
+  if (size == CAPTURE_RAW_FOLD)
+    return 4;
+
+  if (size > 0xffff)
+    return -1;
+
+  return 2 + decoder_packet_words(size);
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t record_frames(decoder_ctx_t *ctx, int ptr)
+{
+  uint32_t *record;
+  uint32_t size;
+
+  if (ctx->decoded)
+  {
+    uint8_t *data = (uint8_t *)ctx->buffer + ptr;
+    uint32_t flags, delta;
+
+    data += compact_header(data, DECODER_COMPACT_HEADER, &flags, &delta);
+
+    if (flags & CAPTURE_FOLDED)
+    {
+      uint32_t count;
+      memcpy(&count, data, sizeof(count));
+      return count;
+    }
+    else if (flags & CAPTURE_LS_SOF)
+      return 1;
+    else if (flags & CAPTURE_RESET)
+      return 0;
+
+    return (flags & CAPTURE_SIZE_MASK) >= 2 &&
+        (data[compact_sync_omitted(flags) ? 0 : 1] & 0x0f) == Pid_Sof;
+  }
+
+  record = &ctx->buffer[ptr];
+  size = record[0] & ~CAPTURE_RAW_OVERFLOW;
+
+  if (size == CAPTURE_RAW_FOLD)
+    return record[2];
+  else if (size == 1)
+    return ctx->fs ? 0 : 1;
+  else if (size > 1)
+    return decoder_raw_pid(ctx->fs, record[2], size-1) == Pid_Sof;
+
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+static int packet_decode(decoder_ctx_t *ctx, int ptr, uint32_t *record)
+{
+  uint32_t size = ctx->buffer[ptr] & ~CAPTURE_RAW_OVERFLOW;
+  int limit = (DECODER_MAX_RECORD - 4) * 31; // Bits that fit into the record after decoding
+  uint32_t time = decoder_start_time(ctx->fs, ctx->buffer[ptr+1], size) - ctx->time_offset;
+  int pid;
+
+  if (size == 0)
+  {
+    record[0] = CAPTURE_RESET;
+    record[2] = 0;
+    pid = -1;
+  }
+  else if (size == 1)
+  {
+    record[0] = CAPTURE_LS_SOF;
+    record[2] = 0;
+    pid = Pid_Sof;
+  }
+  else if ((int)size-1 > limit)
+  {
+    ctx->rd_ptr = ptr + 2;
+    pid = decoder_process_record(ctx, record, limit);
+    record[0] |= CAPTURE_ERROR_SIZE;
+    record[2] = 0;
+  }
+  else
+  {
+    ctx->rd_ptr = ptr + 2;
+    pid = decoder_process_record(ctx, record, size-1);
+  }
+
+  record[1] = time;
+
+  return pid;
+}
+
+//-----------------------------------------------------------------------------
+// Returns the PID of the packet if it is not needed by the caller, the record is
+// then built from the SYNC and PID only. Raw packets are decoded in full while the
+// statistics are collected, the errors of all of them are counted.
+static int packet_skip(decoder_ctx_t *ctx, int ptr, uint32_t *record)
+{
+  uint32_t size = ctx->buffer[ptr] & ~CAPTURE_RAW_OVERFLOW;
+  int pid;
+
+  if (0 == ctx->skip || ctx->counting || size < 2)
+    return -1;
+
+  pid = decoder_raw_pid(ctx->fs, ctx->buffer[ptr+2], size-1);
+
+  if (pid < 0 || 0 == (ctx->skip & (1 << pid)))
+    return -1;
+
+  record[0] = 2;
+  record[1] = decoder_start_time(ctx->fs, ctx->buffer[ptr+1], size) - ctx->time_offset;
+  record[2] = DECODER_FIELDS_VALID | (pid << 24);
+  record[3] = (ctx->fs ? 0x80 : 0x81) | ((pid | ((~pid & 0x0f) << 4)) << 8);
+
+  return pid;
+}
+
+//-----------------------------------------------------------------------------
+static bool frame_empty(decoder_ctx_t *ctx)
+{
+  int ptr = ctx->packet_ptr;
+  int trigger = ctx->trigger_index;
+  bool marked = false;
+
+  // Look ahead until the next SOF, the frame may only contain clean IN and NAK packets
+  for (int i = ctx->packet + 1; i < ctx->count; i++)
+  {
+    uint32_t size;
+    int pid;
+
+    ptr += record_length(ctx, ptr);
+    size = ctx->buffer[ptr];
+
+    if (size & CAPTURE_RAW_OVERFLOW)
+      marked = true;
+
+    size &= ~CAPTURE_RAW_OVERFLOW;
+
+    if (size == CAPTURE_RAW_FOLD || size == 0)
+      return false;
+
+    if (size == 1 && ctx->fs)
+    {
+      if (i == trigger)
+        trigger++; // The markers are moved to the next packet
+
+      continue;
+    }
+
+    if (i == trigger)
+      marked = true;
+
+    pid = packet_decode(ctx, ptr, ctx->record);
+
+    if (pid == Pid_Sof)
+      return true;
+
+    if (marked || (ctx->record[0] & CAPTURE_ERROR_MASK) || (pid != Pid_In && pid != Pid_Nak))
+      return false;
+  }
+
+  return false;
+}
+
+//-----------------------------------------------------------------------------
+// Unpacks a compact record into a packet record, the time delta is added to the
+// given time. Returns the length of the compact record or -1 if it is not valid.
+int decoder_compact_unpack(uint32_t *record, uint8_t *data, int size, bool fs, uint32_t time)
+{
+  uint8_t *out = (uint8_t *)&record[3];
+  uint32_t flags, delta;
+  int header, length;
+
+  if ((header = compact_header(data, size, &flags, &delta)) < 0)
+    return -1;
+
+  length = decoder_compact_size(flags);
+
+  if (length > (size - header))
+    return -1;
+
+  data += header;
+  size = header + length;
+
+  if (compact_sync_omitted(flags))
+    *out++ = fs ? 0x80 : 0x81;
+
+  // Longer records are truncated while capturing
+  if ((flags & CAPTURE_SIZE_MASK) > DECODER_MAX_DATA)
+  {
+    length -= (flags & CAPTURE_SIZE_MASK) - DECODER_MAX_DATA;
+    flags = (flags & ~CAPTURE_SIZE_MASK) | CAPTURE_ERROR_SIZE | DECODER_MAX_DATA;
+  }
+
+  memcpy(out, data, length);
+
+  record[0] = flags;
+  record[1] = time + delta;
+  record[2] = decoder_fields(flags, (uint8_t *)&record[3]);
+
+  return size;
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t *compact_unpack(decoder_ctx_t *ctx, int index)
+{
+  uint8_t *data = (uint8_t *)ctx->buffer + ctx->packet_ptr;
+  int avail = ctx->buffer_size * (int)sizeof(uint32_t) - ctx->packet_ptr;
+  uint32_t time = (index & (DECODER_INDEX_STEP-1)) ? ctx->time : 0;
+  uint32_t *record = ctx->record;
+  uint32_t flags, delta;
+  int header, pid_ptr;
+
+  // The records are checked while the index is built
+  header = compact_header(data, LIMIT(avail, DECODER_COMPACT_HEADER), &flags, &delta);
+  pid_ptr = header + (compact_sync_omitted(flags) ? 0 : 1);
+
+  // The packets not needed by the caller keep the flags, the bytes after the PID are not copied
+  if (ctx->skip && (flags & CAPTURE_SIZE_MASK) >= 2 &&
+      0 == (flags & (CAPTURE_FOLDED | CAPTURE_RESET | CAPTURE_LS_SOF)) &&
+      (ctx->skip & (1 << (data[pid_ptr] & 0x0f))))
+  {
+    uint8_t *out = (uint8_t *)&record[3];
+
+    out[0] = compact_sync_omitted(flags) ? (ctx->fs ? 0x80 : 0x81) : data[header];
+    out[1] = data[pid_ptr];
+
+    record[0] = (flags & ~CAPTURE_SIZE_MASK) | 2;
+    record[1] = time + delta;
+    record[2] = decoder_fields(record[0], out);
+  }
+  else
+  {
+    decoder_compact_unpack(record, data, avail, ctx->fs, time);
+  }
+
+  ctx->time = record[1];
+
+  return ctx->record;
+}
+
+//-----------------------------------------------------------------------------
+// Checks the records and builds the index, the packet index is normally
+// filled while capturing, this is only needed for the buffers assembled later
+bool decoder_index(decoder_ctx_t *ctx)
+{
+  uint32_t frames = 0;
+  int ptr = 0;
+
+  // Compact records are addressed in bytes
+  int size = ctx->buffer_size * (ctx->decoded ? (int)sizeof(uint32_t) : 1);
+
+  for (int i = 0; i < ctx->count; i++)
+  {
+    int length;
+
+    if (0 == (i & (DECODER_INDEX_STEP-1)))
+    {
+      ctx->index[i >> DECODER_INDEX_SHIFT] = ptr;
+      ctx->frame_index[i >> DECODER_INDEX_SHIFT] = frames;
+    }
+
+    if ((ptr + (ctx->decoded ? 1 : 2)) > size)
+      length = -1;
+    else
+      length = record_length(ctx, ptr);
+
+    if (length < 0 || (ptr + length) > size)
+    {
+      ctx->count = 0;
+      return false;
+    }
+
+    frames += record_frames(ctx, ptr);
+    ptr += length;
+  }
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+void decoder_open(decoder_ctx_t *ctx)
+{
+  ctx->time_offset = 0;
+  ctx->markers = 0;
+  ctx->packet = -1;
+  ctx->packet_ptr = 0;
+  ctx->counting = false;
+  ctx->counted = false;
+
+  // Statistics of the raw buffers are collected as the packets are requested
+  if (!ctx->decoded)
+  {
+    ctx->errors = 0;
+    ctx->resets = 0;
+    ctx->frames = 0;
+    ctx->folded = 0;
+  }
+
+  if (!ctx->decoded && ctx->count > 0)
+  {
+    uint32_t size = ctx->buffer[0] & ~CAPTURE_RAW_OVERFLOW;
+
+    ctx->time_offset = (size == CAPTURE_RAW_FOLD) ? ctx->buffer[1] :
+        decoder_start_time(ctx->fs, ctx->buffer[1], size);
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Returns the decoded record of the packet, or NULL if the packet is discarded.
+// The raw packets are decoded on demand into a separate record, which stays
+// valid until the next call. Sequential requests take constant time, the rest
+// start from the nearest index entry.
+uint32_t *decoder_packet(decoder_ctx_t *ctx, int index)
+{
+  uint32_t *record = ctx->record;
+  uint32_t size;
+  int pid;
+
+  if (index > 0 && index == (ctx->packet + 1))
+  {
+    ctx->packet_ptr += record_length(ctx, ctx->packet_ptr);
+  }
+  else
+  {
+    int entry = index >> DECODER_INDEX_SHIFT;
+
+    ctx->packet_ptr = ctx->index[entry];
+    ctx->markers = 0;
+
+    // Overflow markers of the folded and discarded packets are carried to the next packet,
+    // the time of the compact records is accumulated from the index entry
+    for (int i = entry << DECODER_INDEX_SHIFT; i < index; i++)
+    {
+      if (ctx->decoded)
+      {
+        ctx->time = compact_time(ctx, i, ctx->packet_ptr);
+      }
+      else
+      {
+        uint32_t raw = ctx->buffer[ctx->packet_ptr];
+        uint32_t size = raw & ~CAPTURE_RAW_OVERFLOW;
+
+        if (size == CAPTURE_RAW_FOLD || (size == 1 && ctx->fs))
+          ctx->markers |= (raw & CAPTURE_RAW_OVERFLOW) ? CAPTURE_OVERFLOW : 0;
+        else
+          ctx->markers = 0;
+      }
+
+      ctx->packet_ptr += record_length(ctx, ctx->packet_ptr);
+    }
+
+    // Statistics are only valid for the buffer requested in order from the start
+    ctx->counting = (index == 0) && !ctx->decoded && !ctx->counted;
+
+    if (ctx->counting)
+    {
+      ctx->errors = 0;
+      ctx->resets = 0;
+      ctx->frames = 0;
+      ctx->folded = 0;
+    }
+  }
+
+  ctx->packet = index;
+
+  if (ctx->counting && index == (ctx->count - 1))
+    ctx->counted = true;
+
+  if (ctx->decoded)
+    return compact_unpack(ctx, index);
+
+  size = ctx->buffer[ctx->packet_ptr];
+
+  if (size & CAPTURE_RAW_OVERFLOW)
+    ctx->markers |= CAPTURE_OVERFLOW;
+
+  size &= ~CAPTURE_RAW_OVERFLOW;
+
+  if (size == CAPTURE_RAW_FOLD)
+  {
+    uint32_t *raw = &ctx->buffer[ctx->packet_ptr];
+
+    record[0] = CAPTURE_FOLDED | 8;
+    record[1] = raw[1] - ctx->time_offset;
+    record[2] = 0;
+    record[3] = raw[2];
+    record[4] = raw[3] - ctx->time_offset;
+
+    if (ctx->counting)
+    {
+      ctx->frames += raw[2];
+      ctx->folded += raw[2];
+    }
+
+    return record;
+  }
+
+  if (size == 1 && ctx->fs)
+  {
+    if (index == ctx->trigger_index)
+      ctx->trigger_index++;
+
+    return NULL; // The markers are moved to the next packet
+  }
+
+  if (index == ctx->trigger_index)
+    ctx->markers |= CAPTURE_TRIGGER;
+
+  pid = packet_skip(ctx, ctx->packet_ptr, record);
+
+  if (pid < 0)
+    pid = packet_decode(ctx, ctx->packet_ptr, record);
+
+  record[0] |= ctx->markers;
+  ctx->markers = 0;
+
+  if (ctx->counting)
+  {
+    if (record[0] & CAPTURE_RESET)
+      ctx->resets++;
+
+    if (record[0] & CAPTURE_ERROR_MASK)
+      ctx->errors++;
+
+    if (pid == Pid_Sof)
+      ctx->frames++;
+  }
+
+  if (pid == Pid_Sof && 0 == (record[0] & (CAPTURE_ERROR_MASK | CAPTURE_OVERFLOW | CAPTURE_TRIGGER)))
+  {
+    // The record space is reused while looking ahead
+    ctx->sof[0] = record[0];
+    ctx->sof[1] = record[1];
+    ctx->sof[2] = record[2];
+    ctx->sof[3] = record[3];
+    record = ctx->sof;
+
+    if (frame_empty(ctx))
+    {
+      record[0] |= CAPTURE_MAY_FOLD;
+
+      if (ctx->counting)
+        ctx->folded++;
+    }
+  }
+
+  return record;
+}
+
+//-----------------------------------------------------------------------------
+// Returns the packet that starts the frame, or -1 if there are not that many
+// frames in the buffer. Frames are counted from 0 at the start of the buffer,
+// the folded frames start at their run record.
+int decoder_frame_packet(decoder_ctx_t *ctx, uint32_t frame)
+{
+  int low = 0;
+  int high = (ctx->count - 1) >> DECODER_INDEX_SHIFT;
+  uint32_t frames;
+  int ptr;
+
+  if (ctx->count == 0)
+    return -1;
+
+  // The last index entry that starts before the frame
+  while (low < high)
+  {
+    int mid = (low + high + 1) / 2;
+
+    if (ctx->frame_index[mid] <= frame)
+      low = mid;
+    else
+      high = mid - 1;
+  }
+
+  ptr = ctx->index[low];
+  frames = ctx->frame_index[low];
+
+  for (int i = low << DECODER_INDEX_SHIFT; i < ctx->count; i++)
+  {
+    frames += record_frames(ctx, ptr);
+
+    if (frames > frame)
+      return i;
+
+    ptr += record_length(ctx, ptr);
+  }
+
+  return -1;
+}
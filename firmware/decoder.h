@@ -0,0 +1,109 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2022, Alex Taradov <alex@taradov.com>. All rights reserved.
+
+#ifndef _DECODER_H_
+#define _DECODER_H_
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdint.h>
+#include <stdbool.h>
+
+/*- Definitions -------------------------------------------------------------*/
+#define CAPTURE_RAW_OVERFLOW   0x80000000 // Set in the raw size of the packet that ends after the RX FIFO stall
+#define CAPTURE_RAW_FOLD       0x7ffffffe // Raw size of the folded run record [size, start, count, end]
+
+#define DECODER_INDEX_SHIFT    6
+#define DECODER_INDEX_STEP     (1 << DECODER_INDEX_SHIFT) // Packets per entry of the packet index
+#define DECODER_MAX_RECORD     320 // words, enough for the largest FS packet
+#define DECODER_MAX_DATA       ((DECODER_MAX_RECORD - 3) * 4) // bytes
+
+// Token fields of the packet records, parsed from the packet bytes each time a record is built.
+// They are not stored in the capture buffer, the raw and compact records only hold the bytes.
+#define DECODER_FIELDS_VALID     (1u << 31) // The packet has a valid PID and no errors
+#define DECODER_FIELDS_PID(f)    (((f) >> 24) & 0x0f)
+#define DECODER_FIELDS_ADDR(f)   ((f) & 0x7f)        // Also the hub address of SPLIT
+#define DECODER_FIELDS_EP(f)     (((f) >> 7) & 0x0f)
+#define DECODER_FIELDS_FRAME(f)  ((f) & 0x7ff)
+#define DECODER_FIELDS_SC(f)     (((f) >> 7) & 1)
+#define DECODER_FIELDS_PORT(f)   (((f) >> 8) & 0x7f)
+#define DECODER_FIELDS_S(f)      (((f) >> 15) & 1)
+#define DECODER_FIELDS_E(f)      (((f) >> 16) & 1)
+#define DECODER_FIELDS_ET(f)     (((f) >> 17) & 3)
+
+#define DECODER_COMPACT_HEADER   16   // bytes, space reserved for the header of a compact record
+#define DECODER_COMPACT_MAY_FOLD 0x40 // CAPTURE_MAY_FOLD in the first byte of a compact record
+
+/*- Types -------------------------------------------------------------------*/
+typedef struct
+{
+  uint8_t  *out;
+  uint32_t v;
+  uint32_t raw;      // Decoded bits not unstuffed yet
+  uint32_t error;
+  int      size;
+  int      bit;
+  int      byte;
+  int      stuff;
+  int      raw_bits;
+} decoder_t;
+
+typedef struct
+{
+  uint32_t *buffer;
+  int      buffer_size;   // Number of words in the buffer, the raw packets must fit within it
+  bool     fs;
+  int      count;         // Number of raw packets, replaced with the number of records
+  int      trigger_index; // Raw packet to be marked with the trigger, -1 if none
+  int      rd_ptr;
+  int      wr_ptr;
+  int      sof_index;
+  bool     may_fold;
+  int      errors;
+  int      resets;
+  int      frames;
+  int      folded;
+
+  // Packets decoded on demand
+  uint32_t *index;        // Offset of every DECODER_INDEX_STEP-th packet
+  uint32_t *frame_index;  // Number of frames before every DECODER_INDEX_STEP-th packet
+  uint32_t *record;       // Space for the packet record, DECODER_MAX_RECORD words
+  uint32_t sof[4];        // SOF record, while the rest of the frame is checked for folding
+  bool     decoded;       // The buffer contains the compact decoded records, offsets are in bytes
+  bool     counting;      // The packets are requested in order, statistics are collected
+  bool     counted;       // Statistics of all packets were collected, they are not collected again
+  uint32_t time_offset;
+  uint32_t time;          // Time of the last requested compact record
+  uint32_t markers;       // Overflow and trigger markers moved from the discarded packets
+  uint32_t skip;          // Mask of the PIDs not needed by the caller, only SYNC and PID are decoded
+  int      packet;        // Index of the last requested packet
+  int      packet_ptr;    // Offset of the last requested packet
+} decoder_ctx_t;
+
+/*- Prototypes --------------------------------------------------------------*/
+uint16_t crc16_usb(uint8_t *data, int size);
+uint8_t crc5_usb(uint8_t *data, int size);
+
+void decoder_init(decoder_t *dec, uint8_t *out);
+void decoder_word(decoder_t *dec, uint32_t w, int bit_count);
+int decoder_finish(decoder_t *dec, uint32_t *record, bool fs);
+
+int decoder_packet_words(uint32_t size);
+uint32_t decoder_start_time(bool fs, uint32_t end_time, uint32_t size);
+uint32_t decoder_duration(bool fs, uint32_t *record);
+int decoder_raw_pid(bool fs, uint32_t w, int size);
+int decoder_process_packet(decoder_ctx_t *ctx, uint32_t *record, int size);
+uint32_t decoder_fields(uint32_t flags, uint8_t *data);
+int decoder_process_record(decoder_ctx_t *ctx, uint32_t *record, int size);
+void decoder_handle_folding(decoder_ctx_t *ctx, int pid, uint32_t error);
+bool decoder_process_buffer(decoder_ctx_t *ctx);
+int decoder_compact_size(uint32_t flags);
+int decoder_compact_header(uint8_t *out, uint32_t flags, uint32_t delta);
+int decoder_compact_record(uint8_t *out, uint32_t flags, uint32_t delta, uint8_t *data);
+int decoder_compact_unpack(uint32_t *record, uint8_t *data, int size, bool fs, uint32_t time);
+
+bool decoder_index(decoder_ctx_t *ctx);
+void decoder_open(decoder_ctx_t *ctx);
+uint32_t *decoder_packet(decoder_ctx_t *ctx, int index);
+int decoder_frame_packet(decoder_ctx_t *ctx, uint32_t frame);
+
+#endif // _DECODER_H_
@@ -9,35 +9,213 @@
 #include "rp2040.h"
 #include "display.h"
 #include "capture.h"
+#include "decoder.h"
 #include "globals.h"
 #include "utils.h"
 
 /*- Definitions -------------------------------------------------------------*/
 #define ERROR_DATA_SIZE_LIMIT  16
-#define MAX_PACKET_DELTA       10000 // us
+#define MAX_PACKET_DELTA       (10000 * CAPTURE_TICKS_PER_US)
+#define MAX_FOLD_RUN           60000 // frames, the end of the run must be within the time extension range
+#define RING_SIZE              2048  // bytes, must be a power of 2
+#define LINE_SIZE              256   // The longer lines are handed off in parts
+
+#define FILTER_SOF             (1 << 0)
+#define FILTER_TOKEN           (1 << 1)
+#define FILTER_DATA            (1 << 2)
+#define FILTER_HANDSHAKE       (1 << 3)
+#define FILTER_ERROR           (1 << 4)
+#define FILTER_OTHER           (1 << 5)
+#define FILTER_ALL             0x3f
+
+#define HEX_ROW(h)   h"0" h"1" h"2" h"3" h"4" h"5" h"6" h"7" h"8" h"9" h"a" h"b" h"c" h"d" h"e" h"f"
+#define DEC_ROW(d)   d"0" d"1" d"2" d"3" d"4" d"5" d"6" d"7" d"8" d"9"
+
+#define PCAPNG_SHB             0x0a0d0d0a // Section header block
+#define PCAPNG_IDB             1          // Interface description block
+#define PCAPNG_EPB             6          // Enhanced packet block
+#define PCAPNG_BYTE_ORDER      0x1a2b3c4d
+#define PCAPNG_LINKTYPE_USB    288        // LINKTYPE_USB_2_0, the packet starts with the PID
+#define PCAPNG_OPT_END         0
+#define PCAPNG_OPT_FLAGS       2
+#define PCAPNG_OPT_SPEED       8
+#define PCAPNG_OPT_TSRESOL     9
+#define PCAPNG_SHB_SIZE        28
+#define PCAPNG_IDB_SIZE        44
+#define PCAPNG_EPB_SIZE        32
+
+#define PCAPNG_FLAG_CRC        (1u << 24)
+#define PCAPNG_FLAG_LONG       (1u << 25)
+#define PCAPNG_FLAG_UNALIGNED  (1u << 28)
+#define PCAPNG_FLAG_SFD        (1u << 29)
+#define PCAPNG_FLAG_SYMBOL     (1u << 31)
+
+/*- Constants ---------------------------------------------------------------*/
+static const char g_hex_table[] = // Two characters for each byte value
+  HEX_ROW("0") HEX_ROW("1") HEX_ROW("2") HEX_ROW("3") HEX_ROW("4") HEX_ROW("5") HEX_ROW("6") HEX_ROW("7")
+  HEX_ROW("8") HEX_ROW("9") HEX_ROW("a") HEX_ROW("b") HEX_ROW("c") HEX_ROW("d") HEX_ROW("e") HEX_ROW("f");
+
+static const char g_dec_table[] = // Two digits for each value from 0 to 99
+  DEC_ROW("0") DEC_ROW("1") DEC_ROW("2") DEC_ROW("3") DEC_ROW("4")
+  DEC_ROW("5") DEC_ROW("6") DEC_ROW("7") DEC_ROW("8") DEC_ROW("9");
+
+static const uint8_t g_filter_classes[DisplayFilterCount] =
+{
+  [DisplayFilter_All]        = FILTER_ALL,
+  [DisplayFilter_NoSof]      = FILTER_ALL & ~FILTER_SOF,
+  [DisplayFilter_Tokens]     = FILTER_TOKEN,
+  [DisplayFilter_Data]       = FILTER_DATA,
+  [DisplayFilter_Handshakes] = FILTER_HANDSHAKE,
+  [DisplayFilter_Errors]     = FILTER_ERROR,
+};
+
+static const char *g_pid_names[16] =
+{
+  [Pid_Reserved] = "RESERVED",
+  [Pid_Out]      = "OUT",
+  [Pid_In]       = "IN",
+  [Pid_Sof]      = "SOF",
+  [Pid_Setup]    = "SETUP",
+  [Pid_Data0]    = "DATA0",
+  [Pid_Data1]    = "DATA1",
+  [Pid_Data2]    = "DATA2",
+  [Pid_MData]    = "MDATA",
+  [Pid_Ack]      = "ACK",
+  [Pid_Nak]      = "NAK",
+  [Pid_Stall]    = "STALL",
+  [Pid_Nyet]     = "NYET",
+  [Pid_PreErr]   = "PRE/ERR",
+  [Pid_Split]    = "SPLIT",
+  [Pid_Ping]     = "PING",
+};
 
 /*- Variables ---------------------------------------------------------------*/
-static uint32_t g_ref_time;
-static uint32_t g_prev_time;
+static uint8_t g_ring[RING_SIZE];
+static volatile uint32_t g_ring_head; // Written by core1 only
+static volatile uint32_t g_ring_tail; // Written by core0 only
+static uint32_t g_ring_free;          // Free space known to core1
+
+static char g_line[LINE_SIZE];
+static int g_line_ptr;
+
+static uint64_t g_time;
+static uint64_t g_ref_time;
+static uint64_t g_prev_time;
 static bool g_check_delta;
+static bool g_streaming;
 static bool g_folding;
 static int g_fold_count;
-static int g_display_ptr;
+static bool g_binary;
+static bool g_stopped;
+static bool g_frame_fs;
+static uint32_t g_frame_time; // Time of the last packet frame
+static uint32_t g_run[5];     // Folded frames not sent yet, in the form of a run record
+static uint32_t g_skipped[4]; // The last packet skipped while folding, only its time is used
+static bool g_skipped_pending;
+static int g_filter;          // Packet classes passing the display filter, 0 if the filter is off
+static bool g_filter_any;     // Any address and endpoint
+static bool g_filter_token;   // The last token passed the address filter
+static bool g_transactions;
+static int g_trans_token;       // PID of the pending transaction token, -1 if there is none
+static int g_trans_data;        // PID of its data packet, -1 if there is none yet
+static int g_trans_handshake;
+static uint32_t g_trans_fields;
+static uint64_t g_trans_ftime;   // Displayed time of the token
+static uint64_t g_trans_time[3]; // Start of the token, data and handshake packets
+static uint64_t g_trans_end[2];  // EOP of the token and data packets
+static bool g_trans_fs;          // Speed of the packets, from the start frame when rendered on the host
+static uint32_t g_trans_record[DECODER_MAX_RECORD];
 
 /*- Implementations ---------------------------------------------------------*/
 
 //-----------------------------------------------------------------------------
+// The output goes into a ring shared with core0. The indices are free running,
+// the consumer only ever adds space, so the tail is read again only when the
+// known free space runs out.
 void display_putc(char c)
 {
-  while (0 == (SIO->FIFO_ST & SIO_FIFO_ST_RDY_Msk));
-  SIO->FIFO_WR = c;
+  uint32_t head = g_ring_head;
+
+  while (0 == g_ring_free)
+  {
+    g_ring_free = RING_SIZE - (head - g_ring_tail);
+
+    if (0 == g_ring_free)
+      capture_stream_task();
+  }
+
+  g_ring[head & (RING_SIZE-1)] = c;
+  __DMB(); // The data is written before it is published
+
+  g_ring_head = head + 1;
+  g_ring_free--;
+}
+
+//-----------------------------------------------------------------------------
+// Called by core0, copies up to the size bytes of the output and returns the number of copied bytes
+int display_read(uint8_t *data, int size)
+{
+  uint32_t tail = g_ring_tail;
+  uint32_t head = g_ring_head;
+  int offset = tail & (RING_SIZE-1);
+  int span;
+
+  size = LIMIT(size, head - tail);
+  __DMB(); // The data is read after the head
+
+  span = LIMIT(size, RING_SIZE - offset);
+  memcpy(data, &g_ring[offset], span);
+  memcpy(&data[span], g_ring, size - span);
+  __DMB(); // The data is read before the space is released
+
+  g_ring_tail = tail + size;
+
+  return size;
+}
+
+//-----------------------------------------------------------------------------
+// Called by core0, drops the output while the VCP is closed
+void display_discard(void)
+{
+  g_ring_tail = g_ring_head;
+}
+
+//-----------------------------------------------------------------------------
+// Same as display_putc(), but the head is published once for each span
+void display_write(const char *data, int size)
+{
+  uint32_t head = g_ring_head;
+
+  while (size)
+  {
+    int offset = head & (RING_SIZE-1);
+    int span;
+
+    while (0 == g_ring_free)
+    {
+      g_ring_free = RING_SIZE - (head - g_ring_tail);
+
+      if (0 == g_ring_free)
+        capture_stream_task();
+    }
+
+    span = LIMIT(LIMIT(size, g_ring_free), RING_SIZE - offset);
+    memcpy(&g_ring[offset], data, span);
+    __DMB(); // The data is written before it is published
+
+    head += span;
+    g_ring_head = head;
+    g_ring_free -= span;
+
+    data += span;
+    size -= span;
+  }
 }
 
 //-----------------------------------------------------------------------------
 void display_puts(const char *s)
 {
-  while (*s)
-    display_putc(*s++);
+  display_write(s, strlen(s));
 }
 
 //-----------------------------------------------------------------------------
@@ -56,57 +234,153 @@ void display_putdec(uint32_t v, int size)
   display_puts(buf);
 }
 
+//-----------------------------------------------------------------------------
+static void line_flush(void)
+{
+  display_write(g_line, g_line_ptr);
+  g_line_ptr = 0;
+}
+
+//-----------------------------------------------------------------------------
+static char *line_reserve(int size)
+{
+  if ((g_line_ptr + size) > LINE_SIZE)
+    line_flush();
+
+  return &g_line[g_line_ptr];
+}
+
+//-----------------------------------------------------------------------------
+static void line_putc(char c)
+{
+  *line_reserve(1) = c;
+  g_line_ptr++;
+}
+
+//-----------------------------------------------------------------------------
+static void line_puts(const char *s)
+{
+  while (*s)
+    line_putc(*s++);
+}
+
+//-----------------------------------------------------------------------------
+static void line_hex(uint32_t v, int size)
+{
+  char *out = line_reserve(2);
+
+  if (size == 1)
+  {
+    *out = g_hex_table[(v & 0xf) * 2 + 1];
+  }
+  else
+  {
+    out[0] = g_hex_table[(v & 0xff) * 2];
+    out[1] = g_hex_table[(v & 0xff) * 2 + 1];
+  }
+
+  g_line_ptr += size;
+}
+
+//-----------------------------------------------------------------------------
+static void line_bytes(uint8_t *data, int size)
+{
+  for (int i = 0; i < size; i++)
+  {
+    char *out = line_reserve(3);
+
+    out[0] = g_hex_table[data[i] * 2];
+    out[1] = g_hex_table[data[i] * 2 + 1];
+    out[2] = ' ';
+    g_line_ptr += 3;
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Right-aligned in the field of the given width, two digits for each division
+static void line_dec(uint32_t v, int width)
+{
+  char buf[10];
+  char *ptr = &buf[sizeof(buf)];
+  char *out;
+  int len;
+
+  while (v >= 100)
+  {
+    uint32_t remainder;
+
+    hw_divmod_u32(v, 100, &v, &remainder);
+    *--ptr = g_dec_table[remainder * 2 + 1];
+    *--ptr = g_dec_table[remainder * 2];
+  }
+
+  *--ptr = g_dec_table[v * 2 + 1];
+
+  if (v >= 10)
+    *--ptr = g_dec_table[v * 2];
+
+  len = &buf[sizeof(buf)] - ptr;
+  width = (width > len) ? width : len;
+  out = line_reserve(width);
+
+  for (int i = len; i < width; i++)
+    *out++ = ' ';
+
+  memcpy(out, ptr, len);
+  g_line_ptr += width;
+}
+
 //-----------------------------------------------------------------------------
 static void print_errors(uint32_t flags, uint8_t *data, int size)
 {
   flags &= CAPTURE_ERROR_MASK;
 
-  display_puts("ERROR [");
+  line_puts("ERROR [");
 
   while (flags)
   {
-    int bit = (flags & ~(flags-1));
+    uint32_t bit = (flags & ~(flags-1));
 
     if (bit == CAPTURE_ERROR_STUFF)
-      display_puts("STUFF");
+      line_puts("STUFF");
     else if (bit == CAPTURE_ERROR_CRC)
-      display_puts("CRC");
+      line_puts("CRC");
     else if (bit == CAPTURE_ERROR_PID)
-      display_puts("PID");
+      line_puts("PID");
     else if (bit == CAPTURE_ERROR_SYNC)
-      display_puts("SYNC");
+      line_puts("SYNC");
     else if (bit == CAPTURE_ERROR_NBIT)
-      display_puts("NBIT");
+      line_puts("NBIT");
     else if (bit == CAPTURE_ERROR_SIZE)
-      display_puts("SIZE");
+      line_puts("SIZE");
 
     flags &= ~bit;
 
     if (flags)
-      display_puts(", ");
+      line_puts(", ");
   }
 
-  display_puts("]: ");
+  line_puts("]: ");
 
   if (size > 0)
   {
-    display_puts("SYNC = 0x");
-    display_puthex(data[0], 2);
-    display_puts(", ");
+    line_puts("SYNC = 0x");
+    line_hex(data[0], 2);
+    line_puts(", ");
   }
 
   if (size > 1)
   {
-    display_puts("PID = 0x");
-    display_puthex(data[1], 2);
-    display_puts(", ");
+    line_puts("PID = 0x");
+    line_hex(data[1], 2);
+    line_puts(", ");
   }
 
   if (size > 2)
   {
     bool limited = false;
 
-    display_puts("DATA: ");
+    line_puts("DATA: ");
 
     if (size > ERROR_DATA_SIZE_LIMIT)
     {
@@ -114,92 +388,74 @@ static void print_errors(uint32_t flags, uint8_t *data, int size)
       limited = true;
     }
 
-    for (int i = 2; i < size; i++)
-    {
-      display_puthex(data[i], 2);
-      display_putc(' ');
-    }
+    line_bytes(&data[2], size - 2);
 
     if (limited)
-      display_puts("...");
+      line_puts("...");
   }
 
-  display_puts("\r\n");
+  line_puts("\r\n");
 }
 
 //-----------------------------------------------------------------------------
-static void print_sof(uint8_t *data)
+static void print_sof(uint32_t fields)
 {
-  int frame = ((data[3] << 8) | data[2]) & 0x7ff;
-  display_puts("SOF #");
-  display_putdec(frame, 0);
-  display_puts("\r\n");
+  line_puts("SOF #");
+  line_dec(DECODER_FIELDS_FRAME(fields), 0);
+  line_puts("\r\n");
 }
 
 //-----------------------------------------------------------------------------
 static void print_handshake(char *pid)
 {
-  display_puts(pid);
-  display_puts("\r\n");
+  line_puts(pid);
+  line_puts("\r\n");
 }
 
 //-----------------------------------------------------------------------------
-static void print_in_out_setup(char *pid, uint8_t *data)
+static void print_in_out_setup(char *pid, uint32_t fields)
 {
-  int v = (data[3] << 8) | data[2];
-  int addr = v & 0x7f;
-  int ep = (v >> 7) & 0xf;
-
-  display_puts(pid);
-  display_puts(": 0x");
-  display_puthex(addr, 2);
-  display_puts("/");
-  display_puthex(ep, 1);
-  display_puts("\r\n");
+  line_puts(pid);
+  line_puts(": 0x");
+  line_hex(DECODER_FIELDS_ADDR(fields), 2);
+  line_puts("/");
+  line_hex(DECODER_FIELDS_EP(fields), 1);
+  line_puts("\r\n");
 }
 
 //-----------------------------------------------------------------------------
-static void print_split(uint8_t *data)
-{
-  int addr = data[2] & 0x7f;
-  int sc   = (data[2] >> 7) & 1;
-  int port = data[3] & 0x7f;
-  int s    = (data[3] >> 7) & 1;
-  int e    = data[4] & 1;
-  int et   = (data[4] >> 1) & 3;
-
-  display_puts("SPLIT: HubAddr=0x");
-  display_puthex(addr, 2);
-  display_puts(", SC=");
-  display_puthex(sc, 1);
-  display_puts(", Port=");
-  display_puthex(port, 2);
-  display_puts(", S=");
-  display_puthex(s, 1);
-  display_puts(", E=");
-  display_puthex(e, 1);
-  display_puts(", ET=");
-  display_puthex(et, 1);
-  display_puts("\r\n");
+static void print_split(uint32_t fields)
+{
+  line_puts("SPLIT: HubAddr=0x");
+  line_hex(DECODER_FIELDS_ADDR(fields), 2);
+  line_puts(", SC=");
+  line_hex(DECODER_FIELDS_SC(fields), 1);
+  line_puts(", Port=");
+  line_hex(DECODER_FIELDS_PORT(fields), 2);
+  line_puts(", S=");
+  line_hex(DECODER_FIELDS_S(fields), 1);
+  line_puts(", E=");
+  line_hex(DECODER_FIELDS_E(fields), 1);
+  line_puts(", ET=");
+  line_hex(DECODER_FIELDS_ET(fields), 1);
+  line_puts("\r\n");
 }
 
 //-----------------------------------------------------------------------------
 static void print_simple(char *text)
 {
-  display_puts(text);
-  display_puts("\r\n");
+  line_puts(text);
+  line_puts("\r\n");
 }
 
 //-----------------------------------------------------------------------------
-static void print_data(char *pid, uint8_t *data, int size)
+static void print_payload(uint8_t *data, int size)
 {
   size -= 4;
 
-  display_puts(pid);
-
   if (size == 0)
   {
-    display_puts(": ZLP\r\n");
+    line_puts(": ZLP\r\n");
   }
   else
   {
@@ -212,88 +468,386 @@ static void print_data(char *pid, uint8_t *data, int size)
     else if (g_display_data == DisplayData_Limit64)
       limited = LIMIT(size, 64);
 
-    display_puts(" (");
-    display_putdec(size, 0);
-    display_puts("): ");
+    line_puts(" (");
+    line_dec(size, 0);
+    line_puts("): ");
 
-    for (int j = 0; j < limited; j++)
-    {
-      display_puthex(data[j+2], 2);
-      display_putc(' ');
-    }
+    line_bytes(&data[2], limited);
 
     if (limited < size)
-      display_puts("...");
+      line_puts("...");
 
-    display_puts("\r\n");
+    line_puts("\r\n");
   }
 }
 
+//-----------------------------------------------------------------------------
+static void print_data(char *pid, uint8_t *data, int size)
+{
+  line_puts(pid);
+  print_payload(data, size);
+}
+
 //-----------------------------------------------------------------------------
 static void print_g_fold_count(int count)
 {
-  display_puts("   ... : Folded ");
+  line_puts("       ... : Folded ");
 
   if (count == 1)
   {
-    display_puts("1 frame");
+    line_puts("1 frame");
   }
   else
   {
-    display_putdec(count, 0);
-    display_puts(" frames");
+    line_dec(count, 0);
+    line_puts(" frames");
   }
 
-  display_puts("\r\n");
+  line_puts("\r\n");
 }
 
 //-----------------------------------------------------------------------------
 static void print_reset(void)
 {
-  display_puts("--- RESET ---\r\n");
+  line_puts("--- RESET ---\r\n");
+}
+
+//-----------------------------------------------------------------------------
+static void print_overflow(void)
+{
+  line_puts("--- FIFO OVERFLOW, DATA LOST ---\r\n");
+}
+
+//-----------------------------------------------------------------------------
+static void print_trigger(void)
+{
+  line_puts("--- TRIGGER ---\r\n");
 }
 
 //-----------------------------------------------------------------------------
 static void print_ls_sof(void)
 {
-  display_puts("LS SOF\r\n");
+  line_puts("LS SOF\r\n");
 }
 
 //-----------------------------------------------------------------------------
-static void print_time(int time)
+static uint64_t extend_time(uint32_t time)
 {
-  display_putdec(time, 6);
-  display_puts(" : ");
+  // Record timestamps are 32-bit, they are extended assuming that the records are
+  // in order and the gaps between them are shorter than the wrap period (~71 s)
+  g_time += (uint32_t)(time - (uint32_t)g_time);
+  return g_time;
 }
 
 //-----------------------------------------------------------------------------
-static bool print_packet(void)
+static void line_time(uint64_t time, int width)
 {
-  int flags = g_buffer[g_display_ptr];
-  int time  = g_buffer[g_display_ptr+1];
-  int ftime = time - g_ref_time;
-  int delta = time - g_prev_time;
+  uint32_t us = 0, ns, remainder = 0;
+  char *out;
+
+  // Divide by CAPTURE_TICKS_PER_US in 16-bit steps, so that the hardware divider can be used
+  for (int i = 48; i >= 0; i -= 16)
+  {
+    uint32_t q;
+
+    hw_divmod_u32((remainder << 16) | ((time >> i) & 0xffff), CAPTURE_TICKS_PER_US, &q, &remainder);
+    us = (us << 16) | q;
+  }
+
+  hw_divmod_u32(remainder * 1000, CAPTURE_TICKS_PER_US, &ns, &remainder);
+
+  line_dec(us, width);
+
+  // Zero-padded fraction, ns < 1000, so (ns * 41) >> 12 == ns / 100
+  out = line_reserve(4);
+  out[0] = '.';
+  out[1] = '0' + ((ns * 41) >> 12);
+  ns -= ((ns * 41) >> 12) * 100;
+  out[2] = g_dec_table[ns*2];
+  out[3] = g_dec_table[ns*2 + 1];
+  g_line_ptr += 4;
+}
+
+//-----------------------------------------------------------------------------
+static void print_time(uint64_t time)
+{
+  line_time(time, 6);
+  line_puts(" : ");
+}
+
+//-----------------------------------------------------------------------------
+static int record_pid(uint32_t *record)
+{
+  if (record[0] & CAPTURE_LS_SOF)
+    return Pid_Sof;
+
+  if ((record[0] & CAPTURE_FOLDED) || (record[0] & CAPTURE_SIZE_MASK) < 2)
+    return -1;
+
+  return ((uint8_t *)&record[3])[1] & 0x0f;
+}
+
+//-----------------------------------------------------------------------------
+static void filter_init(void)
+{
+  g_filter_any = (g_display_endpoint & 0xffff) == 0xffff;
+
+  for (int i = 0; i < 4; i++)
+    g_filter_any = g_filter_any && (g_display_address[i] == 0xffffffff);
+
+  g_filter = g_filter_classes[g_display_filter];
+  g_filter_token = g_filter_any;
+
+  // SOFs have no address, so they are only displayed without the address filter
+  if (g_filter == FILTER_ALL && g_filter_any)
+    g_filter = 0;
+  else
+    g_filter &= ~FILTER_SOF;
+}
+
+//-----------------------------------------------------------------------------
+// Data and handshake packets belong to the transaction of the last token
+static bool filter_packet(uint32_t *record, int pid)
+{
+  uint32_t flags = record[0];
+
+  if (flags & CAPTURE_RESET)
+    return true;
+
+  if (flags & CAPTURE_ERROR_MASK)
+    return (g_filter & FILTER_ERROR) && g_filter_token;
+
+  if (pid == Pid_Sof || (flags & CAPTURE_LS_SOF))
+  {
+    g_filter_token = g_filter_any;
+    return false;
+  }
+
+  if (pid == Pid_In || pid == Pid_Out || pid == Pid_Setup || pid == Pid_Ping)
+  {
+    int addr = DECODER_FIELDS_ADDR(record[2]);
+    int ep = DECODER_FIELDS_EP(record[2]);
+
+    g_filter_token = (g_display_address[addr / 32] & (1u << (addr % 32))) &&
+        (g_display_endpoint & (1u << ep));
+
+    return (g_filter & FILTER_TOKEN) && g_filter_token;
+  }
+
+  if (pid == Pid_Data0 || pid == Pid_Data1 || pid == Pid_Data2 || pid == Pid_MData)
+    return (g_filter & FILTER_DATA) && g_filter_token;
+
+  if (pid == Pid_Ack || pid == Pid_Nak || pid == Pid_Stall || pid == Pid_Nyet)
+    return (g_filter & FILTER_HANDSHAKE) && g_filter_token;
+
+  if (pid == Pid_Split)
+    return (g_filter & FILTER_TOKEN) && g_filter_any;
+
+  return (g_filter & FILTER_OTHER) && g_filter_any;
+}
+
+//-----------------------------------------------------------------------------
+// PIDs of the packets the filter can't show with or without errors, they are not decoded.
+// The binary output is filtered by the host, all of the packets are sent.
+static uint32_t filter_skip(void)
+{
+  if (!g_filter || g_binary || (g_filter_token && (g_filter & (FILTER_DATA | FILTER_ERROR))))
+    return 0;
+
+  return (1 << Pid_Data0) | (1 << Pid_Data1) | (1 << Pid_Data2) | (1 << Pid_MData);
+}
+
+//-----------------------------------------------------------------------------
+// One line for the token, data and handshake, with the bus turnaround times
+// from the EOP of each packet to the start of the next one
+static void print_transaction(void)
+{
+  uint64_t prev = g_trans_end[0];
+  bool first = true;
+
+  print_time(g_trans_ftime);
+  line_puts(g_pid_names[g_trans_token]);
+  line_puts(" 0x");
+  line_hex(DECODER_FIELDS_ADDR(g_trans_fields), 2);
+  line_puts("/");
+  line_hex(DECODER_FIELDS_EP(g_trans_fields), 1);
+
+  if (g_trans_data >= 0)
+  {
+    line_puts(", ");
+    line_puts(g_pid_names[g_trans_data]);
+  }
+
+  if (g_trans_handshake >= 0)
+  {
+    line_puts(", ");
+    line_puts(g_pid_names[g_trans_handshake]);
+  }
+  else
+  {
+    line_puts((g_trans_data >= 0) ? ", no handshake" : ", no response");
+  }
+
+  for (int i = 1; i < 3; i++)
+  {
+    if ((i == 1 && g_trans_data < 0) || (i == 2 && g_trans_handshake < 0))
+      continue;
+
+    line_puts(first ? ", " : "/");
+    line_time(g_trans_time[i] - prev, 0);
+    prev = g_trans_end[1];
+    first = false;
+  }
+
+  if (!first)
+    line_puts(" us");
+
+  if (g_trans_data >= 0)
+    print_payload((uint8_t *)&g_trans_record[3], g_trans_record[0] & CAPTURE_SIZE_MASK);
+  else
+    line_puts("\r\n");
+
+  g_trans_token = -1;
+}
+
+//-----------------------------------------------------------------------------
+static void transaction_flush(void)
+{
+  if (g_trans_token >= 0)
+    print_transaction();
+}
+
+//-----------------------------------------------------------------------------
+// Collects the packets of the transaction in a single pass, the line is printed
+// once the handshake is seen or the transaction is interrupted by another packet.
+// Returns false if the packet is not a part of a transaction.
+static bool transaction_packet(uint32_t *record, int pid, uint64_t ftime, uint64_t time)
+{
+  if (record[0] & (CAPTURE_ERROR_MASK | CAPTURE_RESET | CAPTURE_LS_SOF))
+    pid = -1;
+
+  if (pid == Pid_In || pid == Pid_Out || pid == Pid_Setup || pid == Pid_Ping)
+  {
+    transaction_flush();
+
+    g_trans_token     = pid;
+    g_trans_data      = -1;
+    g_trans_handshake = -1;
+    g_trans_fields    = record[2];
+    g_trans_ftime     = ftime;
+    g_trans_time[0]   = time;
+    g_trans_end[0]    = time + decoder_duration(g_trans_fs, record);
+
+    return true;
+  }
+
+  if ((pid == Pid_Data0 || pid == Pid_Data1 || pid == Pid_Data2 || pid == Pid_MData) &&
+      g_trans_token >= 0 && g_trans_token != Pid_Ping && g_trans_data < 0)
+  {
+    int size = record[0] & CAPTURE_SIZE_MASK;
+
+    // The record may be decoded into a shared buffer, so the payload is copied
+    memcpy(g_trans_record, record, 3 * sizeof(uint32_t) + size);
+    g_trans_data    = pid;
+    g_trans_time[1] = time;
+    g_trans_end[1]  = time + decoder_duration(g_trans_fs, record);
+
+    return true;
+  }
+
+  if ((pid == Pid_Ack || pid == Pid_Nak || pid == Pid_Stall || pid == Pid_Nyet) && g_trans_token >= 0)
+  {
+    g_trans_handshake = pid;
+    g_trans_time[2]   = time;
+    print_transaction();
+
+    return true;
+  }
+
+  transaction_flush();
+
+  return false;
+}
+
+//-----------------------------------------------------------------------------
+static bool format_packet(uint32_t *record)
+{
+  int flags = record[0];
+  uint64_t time  = extend_time(record[1]);
+  uint64_t ftime = time - g_ref_time;
+  uint64_t delta = time - g_prev_time;
   int size  = flags & CAPTURE_SIZE_MASK;
-  uint8_t *payload = (uint8_t *)&g_buffer[g_display_ptr+2];
-  int pid = payload[1] & 0x0f;
+  uint32_t fields = record[2];
+  uint8_t *payload = (uint8_t *)&record[3];
+  int pid = record_pid(record);
 
   if (g_check_delta && delta > MAX_PACKET_DELTA)
   {
-    display_puts("Time delta between packets is too large, possible buffer corruption.\r\n");
+    transaction_flush();
+    line_puts("Time delta between packets is too large, possible buffer corruption.\r\n");
     return false;
   }
 
-  g_display_ptr += (((size+3)/4) + 2);
-
   g_prev_time = time;
-  g_check_delta = true;
+  g_check_delta = !g_streaming;
 
-  if (flags & CAPTURE_LS_SOF)
-    pid = Pid_Sof;
+  if (flags & CAPTURE_FOLDED)
+  {
+    uint32_t *run = (uint32_t *)payload; // Frame count and the time of the last folded SOF
+
+    g_prev_time = extend_time(run[1]);
+
+    if (g_display_time == DisplayTime_SOF || g_display_time == DisplayTime_Previous)
+      g_ref_time = g_prev_time;
+
+    g_filter_token = g_filter_any;
+
+    transaction_flush();
+
+    if (g_folding)
+    {
+      g_fold_count += run[0];
+    }
+    else if (g_display_fold == DisplayFold_Enabled)
+    {
+      g_folding = true;
+      g_fold_count = run[0];
+    }
+    else
+    {
+      print_g_fold_count(run[0]);
+    }
+
+    return true;
+  }
 
   if ((g_display_time == DisplayTime_SOF && pid == Pid_Sof) || (g_display_time == DisplayTime_Previous))
     g_ref_time = time;
 
+  if (flags & (CAPTURE_OVERFLOW | CAPTURE_TRIGGER))
+  {
+    transaction_flush();
+
+    if (g_folding)
+    {
+      print_g_fold_count(g_fold_count);
+      g_folding = false;
+    }
+
+    if (flags & CAPTURE_OVERFLOW)
+    {
+      print_time(ftime);
+      print_overflow();
+    }
+
+    if (flags & CAPTURE_TRIGGER)
+    {
+      print_time(ftime);
+      print_trigger();
+    }
+  }
+
+  // Folding is decided on all packets, the empty frames are folded the same way with the filter
   if (g_folding)
   {
     if (pid != Pid_Sof)
@@ -309,13 +863,23 @@ static bool print_packet(void)
     g_folding = false;
   }
 
-  if (flags & CAPTURE_MAY_FOLD && g_display_fold == DisplayFold_Enabled)
+  // Nothing is pending while folding, the SOF that starts folding ends the transaction
+  if (flags & CAPTURE_MAY_FOLD && !(flags & (CAPTURE_OVERFLOW | CAPTURE_TRIGGER)) && g_display_fold == DisplayFold_Enabled)
   {
+    transaction_flush();
+    g_filter_token = g_filter_any;
     g_folding = true;
     g_fold_count = 1;
     return true;
   }
 
+  // The filtered packets still update the time references, so the displayed times don't change
+  if (g_filter && !filter_packet(record, pid))
+    return true;
+
+  if (g_transactions && transaction_packet(record, pid, ftime, time))
+    return true;
+
   print_time(ftime);
 
   if (flags & CAPTURE_RESET)
@@ -343,13 +907,13 @@ static bool print_packet(void)
   }
 
   if (pid == Pid_Sof)
-    print_sof(payload);
+    print_sof(fields);
   else if (pid == Pid_In)
-    print_in_out_setup("IN", payload);
+    print_in_out_setup("IN", fields);
   else if (pid == Pid_Out)
-    print_in_out_setup("OUT", payload);
+    print_in_out_setup("OUT", fields);
   else if (pid == Pid_Setup)
-    print_in_out_setup("SETUP", payload);
+    print_in_out_setup("SETUP", fields);
 
   else if (pid == Pid_Ack)
     print_handshake("ACK");
@@ -374,13 +938,24 @@ static bool print_packet(void)
   else if (pid == Pid_PreErr)
     print_simple("PRE/ERR");
   else if (pid == Pid_Split)
-    print_split(payload);
+    print_split(fields);
   else if (pid == Pid_Reserved)
     print_simple("RESERVED");
 
   return true;
 }
 
+//-----------------------------------------------------------------------------
+// The packet lines are built in the line buffer and handed off all at once
+static bool print_packet(uint32_t *record)
+{
+  bool res = format_packet(record);
+
+  line_flush();
+
+  return res;
+}
+
 //-----------------------------------------------------------------------------
 void display_value(int value, char *name)
 {
@@ -393,32 +968,46 @@ void display_value(int value, char *name)
 }
 
 //-----------------------------------------------------------------------------
-void display_buffer(void)
+static void print_capture_rate(void)
 {
-  if (g_buffer_info.count == 0)
+  uint32_t ms, rate, remainder;
+
+  hw_divmod_u32(g_buffer_info.duration, 1000, &ms, &remainder);
+
+  display_puts("Capture: ");
+  display_putdec(ms, 0);
+  display_puts(" ms");
+
+  if (ms > 0)
   {
-    display_puts("\r\nCapture buffer is empty\r\n");
-    return;
+    hw_divmod_u32(g_buffer_info.count * 1000, ms, &rate, &remainder);
+    display_puts(", ");
+    display_putdec(rate, 0);
+    display_puts(" packets/s");
   }
 
-  display_puts("\r\nCapture buffer:\r\n");
+  display_puts(", peak ");
+  display_value(g_buffer_info.peak_rate, "packet");
+  display_puts(" in 1 ms");
 
-  g_ref_time    = g_buffer[1];
-  g_prev_time   = g_buffer[1];
-  g_folding     = false;
-  g_check_delta = true;
-  g_fold_count  = 0;
-  g_display_ptr = 0;
+  if (g_buffer_info.dma)
+  {
+    display_puts(", peak DMA backlog ");
+    display_value(g_buffer_info.backlog, "word");
+  }
 
-  for (int i = 0; i < g_buffer_info.count; i++)
+  if (g_buffer_info.stream)
   {
-    if (!print_packet())
-      break;
+    display_puts(", ");
+    display_value(g_buffer_info.dropped, "dropped packet");
   }
 
-  if (g_folding && g_fold_count)
-    print_g_fold_count(g_fold_count);
+  display_puts("\r\n");
+}
 
+//-----------------------------------------------------------------------------
+static void print_summary(void)
+{
   display_puts("\r\n");
   display_puts("Total: ");
   display_value(g_buffer_info.errors, "error");
@@ -430,5 +1019,432 @@ void display_buffer(void)
   display_value(g_buffer_info.frames, "frame");
   display_puts(", ");
   display_value(g_buffer_info.folded, "empty frame");
-  display_puts("\r\n\r\n");
+  display_puts(", ");
+  display_value(g_buffer_info.overflows, "FIFO overflow");
+  display_puts("\r\n");
+  print_capture_rate();
+  display_puts("\r\n");
+}
+
+//-----------------------------------------------------------------------------
+static void put_frame_header(int type, int size)
+{
+  display_putc(DISPLAY_FRAME_SYNC);
+  display_putc(type);
+  display_putc(size & 0xff);
+  display_putc(size >> 8);
+}
+
+//-----------------------------------------------------------------------------
+static void put_bytes(uint8_t *data, int size)
+{
+  for (int i = 0; i < size; i++)
+    display_putc(data[i]);
+}
+
+//-----------------------------------------------------------------------------
+static void put_u16(uint32_t v)
+{
+  display_putc(v);
+  display_putc(v >> 8);
+}
+
+//-----------------------------------------------------------------------------
+static void put_u32(uint32_t v)
+{
+  put_u16(v);
+  put_u16(v >> 16);
+}
+
+//-----------------------------------------------------------------------------
+static uint64_t time_to_ns(uint64_t time)
+{
+  uint64_t ns = 0;
+  uint32_t remainder = 0;
+
+  time *= 1000;
+
+  // Divide in 16-bit steps, so that the hardware divider can be used
+  for (int i = 48; i >= 0; i -= 16)
+  {
+    uint32_t q;
+
+    hw_divmod_u32((remainder << 16) | ((time >> i) & 0xffff), CAPTURE_TICKS_PER_US, &q, &remainder);
+    ns = (ns << 16) | q;
+  }
+
+  return ns;
+}
+
+//-----------------------------------------------------------------------------
+static void export_header(void)
+{
+  // The section length is not known in advance
+  put_u32(PCAPNG_SHB);
+  put_u32(PCAPNG_SHB_SIZE);
+  put_u32(PCAPNG_BYTE_ORDER);
+  put_u16(1);
+  put_u16(0);
+  put_u32(0xffffffff);
+  put_u32(0xffffffff);
+  put_u32(PCAPNG_SHB_SIZE);
+
+  put_u32(PCAPNG_IDB);
+  put_u32(PCAPNG_IDB_SIZE);
+  put_u16(PCAPNG_LINKTYPE_USB);
+  put_u16(0);
+  put_u32(0); // No snapshot length limit
+  put_u16(PCAPNG_OPT_SPEED);
+  put_u16(8);
+  put_u32(g_buffer_info.fs ? 12000000 : 1500000);
+  put_u32(0);
+  put_u16(PCAPNG_OPT_TSRESOL);
+  put_u16(1);
+  put_u32(9); // Nanoseconds, padded to 4 bytes
+  put_u32(PCAPNG_OPT_END);
+  put_u32(PCAPNG_IDB_SIZE);
+}
+
+//-----------------------------------------------------------------------------
+// Largest size of a valid packet with this PID, including SYNC
+static int export_max_size(int pid, bool pid_error)
+{
+  if (pid_error || pid == Pid_Data0 || pid == Pid_Data1 || pid == Pid_Data2 || pid == Pid_MData)
+    return 1 + 1 + (g_buffer_info.fs ? 1023 : 8) + 2;
+  else if (pid == Pid_Split)
+    return 5;
+  else if (pid == Pid_Sof || pid == Pid_In || pid == Pid_Out || pid == Pid_Setup || pid == Pid_Ping)
+    return 4;
+
+  return 2;
+}
+
+//-----------------------------------------------------------------------------
+static void export_packet(uint32_t *record)
+{
+  uint32_t flags = record[0];
+  uint64_t ns = time_to_ns(extend_time(record[1]));
+  int size = (flags & CAPTURE_SIZE_MASK) - 1;
+  uint8_t *data = (uint8_t *)&record[3] + 1;
+  int padding = (4 - (size & 3)) & 3;
+  uint32_t errors = 0;
+  int length;
+
+  // Bus resets, keep-alives and folded frames have no representation in this link type
+  if ((flags & (CAPTURE_FOLDED | CAPTURE_RESET | CAPTURE_LS_SOF)) || size < 1)
+    return;
+
+  if (flags & CAPTURE_ERROR_CRC)
+    errors |= PCAPNG_FLAG_CRC;
+
+  // Other size errors are packets too short for their PID, they can't pass the CRC check
+  if ((size + 1) > export_max_size(data[0] & 0x0f, flags & CAPTURE_ERROR_PID))
+    errors |= PCAPNG_FLAG_LONG;
+  else if (flags & CAPTURE_ERROR_SIZE)
+    errors |= PCAPNG_FLAG_CRC;
+
+  if (flags & CAPTURE_ERROR_NBIT)
+    errors |= PCAPNG_FLAG_UNALIGNED;
+
+  if (flags & CAPTURE_ERROR_SYNC)
+    errors |= PCAPNG_FLAG_SFD;
+
+  if (flags & CAPTURE_ERROR_STUFF)
+    errors |= PCAPNG_FLAG_SYMBOL;
+
+  length = PCAPNG_EPB_SIZE + size + padding + (errors ? 12 : 0);
+
+  // The SYNC byte is not a part of the packet for this link type
+  put_u32(PCAPNG_EPB);
+  put_u32(length);
+  put_u32(0);
+  put_u32(ns >> 32);
+  put_u32(ns);
+  put_u32(size);
+  put_u32(size);
+  put_bytes(data, size);
+
+  for (int i = 0; i < padding; i++)
+    display_putc(0);
+
+  if (errors)
+  {
+    put_u16(PCAPNG_OPT_FLAGS);
+    put_u16(4);
+    put_u32(errors);
+    put_u32(PCAPNG_OPT_END);
+  }
+
+  put_u32(length);
+}
+
+//-----------------------------------------------------------------------------
+// The packet is sent as a compact record with the time from the previous packet,
+// the token fields are parsed again on the host
+static void send_packet(uint32_t *record)
+{
+  uint8_t header[DECODER_COMPACT_HEADER];
+  int length = decoder_compact_header(header, record[0], record[1] - g_frame_time);
+  int size = decoder_compact_size(record[0]);
+  uint8_t *data = (uint8_t *)&record[3] + (record[0] & CAPTURE_SIZE_MASK) - size;
+
+  put_frame_header(DisplayFrame_Packet, length + size);
+  put_bytes(header, length);
+  put_bytes(data, size);
+
+  g_frame_time = record[1];
+}
+
+//-----------------------------------------------------------------------------
+static void send_run(void)
+{
+  if (g_run[3])
+    send_packet(g_run);
+
+  if (g_skipped_pending)
+    send_packet(g_skipped);
+
+  g_run[3] = 0;
+  g_skipped_pending = false;
+}
+
+//-----------------------------------------------------------------------------
+// Folding is repeated on the host, but the folded frames are merged into
+// run records here, so that they don't take the bandwidth
+static void send_folded(uint32_t *record)
+{
+  uint32_t flags = record[0];
+
+  if (g_display_fold != DisplayFold_Enabled)
+  {
+    send_packet(record);
+    return;
+  }
+
+  if ((flags & CAPTURE_FOLDED) ||
+      ((flags & CAPTURE_MAY_FOLD) && !(flags & (CAPTURE_OVERFLOW | CAPTURE_TRIGGER))))
+  {
+    if (0 == g_run[3])
+    {
+      g_run[0] = CAPTURE_FOLDED | 8;
+      g_run[1] = record[1];
+      g_run[2] = 0;
+    }
+
+    g_run[3] += (flags & CAPTURE_FOLDED) ? record[3] : 1;
+    g_run[4] = (flags & CAPTURE_FOLDED) ? record[4] : record[1];
+    g_skipped_pending = false;
+
+    if (g_run[3] >= MAX_FOLD_RUN)
+      send_run();
+  }
+  else if (g_run[3] && record_pid(record) != Pid_Sof && !(flags & (CAPTURE_OVERFLOW | CAPTURE_TRIGGER)))
+  {
+    int size = LIMIT(flags & CAPTURE_SIZE_MASK, 4);
+
+    g_skipped[0] = (flags & ~CAPTURE_SIZE_MASK) | size;
+    g_skipped[1] = record[1];
+    g_skipped[2] = record[2];
+    g_skipped[3] = record[3];
+    g_skipped_pending = true;
+  }
+  else
+  {
+    send_run();
+    send_packet(record);
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void begin_packets(bool streaming)
+{
+  g_time        = 0;
+  g_ref_time    = 0;
+  g_prev_time   = 0;
+  g_folding     = false;
+  g_check_delta = false; // The first packet is not checked, the range may start anywhere
+  g_streaming   = streaming;
+  g_fold_count  = 0;
+  g_binary      = (g_display_output == DisplayOutput_Binary);
+  g_frame_time  = 0;
+  g_run[3]      = 0;
+  g_skipped_pending = false;
+  g_transactions = (g_display_view == DisplayView_Transactions);
+  g_trans_token  = -1;
+  g_trans_fs     = g_buffer_info.fs;
+
+  filter_init();
+
+  if (g_binary)
+  {
+    uint8_t settings[25] = { streaming, g_display_time, g_display_data, g_display_fold,
+        g_buffer_info.fs, g_display_filter, g_display_endpoint, g_display_endpoint >> 8 };
+
+    memcpy(&settings[8], g_display_address, sizeof(g_display_address));
+    settings[24] = g_display_view;
+    put_frame_header(DisplayFrame_Start, sizeof(settings));
+    put_bytes(settings, sizeof(settings));
+  }
+}
+
+//-----------------------------------------------------------------------------
+static bool output_packet(uint32_t *record)
+{
+  if (!g_binary)
+    return print_packet(record);
+
+  send_folded(record);
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+static void end_packets(void)
+{
+  if (g_binary)
+  {
+    send_run();
+    put_frame_header(DisplayFrame_End, 0);
+  }
+  else
+  {
+    transaction_flush();
+
+    if (g_folding && g_fold_count)
+      print_g_fold_count(g_fold_count);
+
+    line_flush();
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void print_packets(int first, int last)
+{
+  begin_packets(false);
+
+  for (int i = first; i < last; i++)
+  {
+    uint32_t *record = capture_packet(i, filter_skip());
+
+    if (record && !output_packet(record))
+      break;
+  }
+
+  end_packets();
+}
+
+//-----------------------------------------------------------------------------
+void display_buffer(void)
+{
+  if (g_buffer_info.count == 0)
+  {
+    display_puts("\r\nCapture buffer is empty\r\n");
+    return;
+  }
+
+  display_puts("\r\nCapture buffer:\r\n");
+
+  print_packets(0, g_buffer_info.count);
+  print_summary();
+}
+
+//-----------------------------------------------------------------------------
+void display_range(int first, int last)
+{
+  if (g_buffer_info.count == 0)
+  {
+    display_puts("\r\nCapture buffer is empty\r\n");
+    return;
+  }
+
+  display_puts("\r\nCapture buffer, packets ");
+  display_putdec(first + 1, 0);
+  display_puts(" to ");
+  display_putdec(last, 0);
+  display_puts(" of ");
+  display_putdec(g_buffer_info.count, 0);
+  display_puts(":\r\n");
+
+  print_packets(first, last);
+}
+
+//-----------------------------------------------------------------------------
+// Writes the buffer as a pcapng file, nothing else is sent, so the output can be
+// saved directly. Packet times are relative to the start of the capture.
+void display_pcapng(void)
+{
+  if (g_buffer_info.count == 0)
+  {
+    display_puts("\r\nCapture buffer is empty\r\n");
+    return;
+  }
+
+  g_time = 0;
+
+  export_header();
+
+  for (int i = 0; i < g_buffer_info.count; i++)
+  {
+    uint32_t *record = capture_packet(i, 0);
+
+    if (record)
+      export_packet(record);
+  }
+}
+
+//-----------------------------------------------------------------------------
+void display_stream_start(void)
+{
+  begin_packets(true);
+}
+
+//-----------------------------------------------------------------------------
+void display_stream_packet(uint32_t *record)
+{
+  output_packet(record);
+}
+
+//-----------------------------------------------------------------------------
+void display_stream_end(void)
+{
+  end_packets();
+  print_summary();
+}
+
+//-----------------------------------------------------------------------------
+// Renders a frame of the binary output as the text it replaces, the host side
+// passes the bytes outside of the frames to display_putc() unchanged
+void display_frame(int type, uint8_t *data, int size)
+{
+  static uint32_t record[DECODER_MAX_RECORD];
+
+  if (type == DisplayFrame_Start && size >= 25 && data[5] < DisplayFilterCount &&
+      data[24] < DisplayViewCount)
+  {
+    g_display_output = DisplayOutput_Text;
+    g_display_time = data[1];
+    g_display_data = data[2];
+    g_display_fold = data[3];
+    g_frame_fs = data[4];
+    g_display_filter = data[5];
+    g_display_endpoint = data[6] | (data[7] << 8);
+    memcpy(g_display_address, &data[8], sizeof(g_display_address));
+    g_display_view = data[24];
+    begin_packets(data[0]);
+    g_trans_fs = g_frame_fs;
+    g_stopped = false;
+  }
+  else if (type == DisplayFrame_Packet)
+  {
+    if (decoder_compact_unpack(record, data, size, g_frame_fs, g_frame_time) != size)
+      return;
+
+    g_frame_time = record[1];
+
+    if (!g_stopped)
+      g_stopped = !print_packet(record);
+  }
+  else if (type == DisplayFrame_End)
+  {
+    end_packets();
+  }
 }
@@ -7,12 +7,33 @@
 /*- Includes ----------------------------------------------------------------*/
 #include <stdint.h>
 
+/*- Definitions -------------------------------------------------------------*/
+#define DISPLAY_FRAME_SYNC     0xa5 // Starts a frame of the binary output, text is 7-bit
+#define DISPLAY_FRAME_HEADER   4    // SYNC, type, 16-bit payload size
+
+/*- Types -------------------------------------------------------------------*/
+enum
+{
+  DisplayFrame_Start  = 1, // Streaming flag, display settings, FS flag, display filter and view
+  DisplayFrame_Packet = 2, // Compact record with the time from the previous packet
+  DisplayFrame_End    = 3,
+};
+
 /*- Prototypes --------------------------------------------------------------*/
 void display_putc(char c);
+void display_write(const char *data, int size);
+int display_read(uint8_t *data, int size);
+void display_discard(void);
 void display_puts(const char *s);
 void display_puthex(uint32_t v, int size);
 void display_putdec(uint32_t v, int size);
 
 void display_buffer(void);
+void display_range(int first, int last);
+void display_pcapng(void);
+void display_stream_start(void);
+void display_stream_packet(uint32_t *record);
+void display_stream_end(void);
+void display_frame(int type, uint8_t *data, int size);
 
 #endif // _DISPLAY_H_
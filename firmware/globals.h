@@ -38,16 +38,54 @@ enum
 {
   CaptureSpeed_Low,
   CaptureSpeed_Full,
+  CaptureSpeed_Auto,
   CaptureSpeedCount,
 };
 
 enum
 {
-  CaptureTrigger_Enabled,
+  CaptureMode_Polling,
+  CaptureMode_Dma,
+  CaptureMode_Streaming,
+  CaptureModeCount,
+};
+
+enum
+{
+  CaptureTrigger_External,
+  CaptureTrigger_Setup,
+  CaptureTrigger_Stall,
+  CaptureTrigger_Reset,
+  CaptureTrigger_Error,
+  CaptureTrigger_Match,
   CaptureTrigger_Disabled,
   CaptureTriggerCount,
 };
 
+enum
+{
+  CapturePretrigger_None,
+  CapturePretrigger_10,
+  CapturePretrigger_50,
+  CapturePretrigger_90,
+  CapturePretrigger_100,
+  CapturePretriggerCount,
+};
+
+enum
+{
+  CaptureFold_Disabled,
+  CaptureFold_Enabled,
+  CaptureFoldCount,
+};
+
+enum
+{
+  CaptureDecode_Disabled,
+  CaptureDecode_Enabled,
+  CaptureDecodeCount,
+};
+
 enum
 {
   CaptureLimit_100,
@@ -86,16 +124,50 @@ enum
   DisplayFoldCount,
 };
 
+enum
+{
+  DisplayFilter_All,
+  DisplayFilter_NoSof,
+  DisplayFilter_Tokens,
+  DisplayFilter_Data,
+  DisplayFilter_Handshakes,
+  DisplayFilter_Errors,
+  DisplayFilterCount,
+};
+
+enum
+{
+  DisplayView_Packets,
+  DisplayView_Transactions,
+  DisplayViewCount,
+};
+
+enum
+{
+  DisplayOutput_Text,
+  DisplayOutput_Binary,
+  DisplayOutputCount,
+};
+
 /*- Variables ---------------------------------------------------------------*/
 extern uint32_t g_buffer[BUFFER_SIZE];
 extern buffer_info_t g_buffer_info;
 
 extern int g_capture_speed;
+extern int g_capture_mode;
 extern int g_capture_trigger;
+extern int g_capture_pretrigger;
 extern int g_capture_limit;
+extern int g_capture_fold;
+extern int g_capture_decode;
 extern int g_display_time;
 extern int g_display_data;
 extern int g_display_fold;
+extern int g_display_filter;
+extern uint32_t g_display_address[4]; // Bit mask of the displayed device addresses
+extern uint32_t g_display_endpoint;   // Bit mask of the displayed endpoints
+extern int g_display_view;
+extern int g_display_output;
 
 /*- Prototypes --------------------------------------------------------------*/
 void set_error(bool error);
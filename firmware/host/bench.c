@@ -0,0 +1,740 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2022, Alex Taradov <alex@taradov.com>. All rights reserved.
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include "rp2040.h"
+#include "capture.h"
+#include "decoder.h"
+#include "display.h"
+#include "globals.h"
+
+/*- Definitions -------------------------------------------------------------*/
+#define DEFAULT_ITERATIONS     10
+#define OUTPUT_CHUNK           64 // Size of the USB buffer on the device
+#define FS_BIT_TICKS           (CAPTURE_TICKS_PER_US / 12)
+#define FRAME_TICKS            (1000 * CAPTURE_TICKS_PER_US)
+#define PACKET_GAP_TICKS       (8 * FS_BIT_TICKS)
+#define MAX_PACKET_SIZE        (1 + 1 + 64 + 2) // SYNC, PID, data, CRC
+#define MAX_PACKET_SAMPLES     (MAX_PACKET_SIZE * 8 * 7 / 6 + 2)
+#define BULK_PACKETS_PER_FRAME 17
+
+/*- Types -------------------------------------------------------------------*/
+typedef struct
+{
+  const char *name;
+  void (*generate)(void);
+} scenario_t;
+
+/*- Variables ---------------------------------------------------------------*/
+uint32_t g_buffer[BUFFER_SIZE];
+buffer_info_t g_buffer_info;
+
+int g_capture_speed      = CaptureSpeed_Full;
+int g_capture_mode       = CaptureMode_Polling;
+int g_capture_trigger    = CaptureTrigger_Disabled;
+int g_capture_pretrigger = CapturePretrigger_None;
+int g_capture_limit      = CaptureLimit_Unlimited;
+int g_capture_fold       = CaptureFold_Disabled;
+int g_capture_decode     = CaptureDecode_Disabled;
+int g_display_time       = DisplayTime_First;
+int g_display_data       = DisplayData_Full;
+int g_display_fold       = DisplayFold_Enabled;
+int g_display_filter     = DisplayFilter_All;
+uint32_t g_display_address[4] = { 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff };
+uint32_t g_display_endpoint   = 0xffff;
+int g_display_view       = DisplayView_Packets;
+int g_display_output     = DisplayOutput_Text;
+
+static uint32_t g_raw[BUFFER_SIZE];
+static uint32_t g_index[BUFFER_SIZE / 2 / DECODER_INDEX_STEP + 1];
+static uint32_t g_frame_index[BUFFER_SIZE / 2 / DECODER_INDEX_STEP + 1];
+static uint32_t g_record[DECODER_MAX_RECORD];
+static decoder_ctx_t g_ctx;
+static int g_raw_ptr;
+static int g_raw_count;
+static bool g_raw_full;
+static uint32_t g_raw_time;
+static uint32_t g_rand = 0x12345678;
+static int g_toggle;
+
+static uint64_t g_output_count;
+static FILE *g_output;
+static bool g_export;
+
+/*- Implementations ---------------------------------------------------------*/
+
+//-----------------------------------------------------------------------------
+// Takes the place of core0, which copies the output into the USB buffers
+static void drain_output(void)
+{
+  uint8_t data[OUTPUT_CHUNK];
+  int size;
+
+  while ((size = display_read(data, sizeof(data))) > 0)
+  {
+    if (g_output)
+      fwrite(data, 1, size, g_output);
+
+    g_output_count += size;
+  }
+}
+
+//-----------------------------------------------------------------------------
+uint32_t *capture_packet(int index, uint32_t skip)
+{
+  uint32_t *record;
+
+  g_ctx.skip = skip;
+  record = decoder_packet(&g_ctx, index);
+
+  if (g_ctx.counting)
+  {
+    g_buffer_info.errors = g_ctx.errors;
+    g_buffer_info.resets = g_ctx.resets;
+    g_buffer_info.frames = g_ctx.frames;
+    g_buffer_info.folded = g_ctx.folded;
+  }
+
+  return record;
+}
+
+//-----------------------------------------------------------------------------
+void set_error(bool error)
+{
+  (void)error;
+}
+
+//-----------------------------------------------------------------------------
+void capture_stream_task(void)
+{
+  drain_output();
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t rand_next(void)
+{
+  g_rand ^= g_rand << 13;
+  g_rand ^= g_rand >> 17;
+  g_rand ^= g_rand << 5;
+  return g_rand;
+}
+
+//-----------------------------------------------------------------------------
+static bool raw_space(int words)
+{
+  if (g_raw_full || (g_raw_ptr + words) > (BUFFER_SIZE-4))
+    g_raw_full = true;
+
+  return !g_raw_full;
+}
+
+//-----------------------------------------------------------------------------
+static void raw_reset(void)
+{
+  if (!raw_space(2))
+    return;
+
+  g_raw_time += 3 * FRAME_TICKS;
+  g_raw[g_raw_ptr++] = 0;
+  g_raw[g_raw_ptr++] = g_raw_time;
+  g_raw_count++;
+}
+
+//-----------------------------------------------------------------------------
+static void raw_frame(void)
+{
+  uint32_t start = (g_raw_time / FRAME_TICKS + 1) * FRAME_TICKS;
+
+  if (g_raw_time < start)
+    g_raw_time = start;
+}
+
+//-----------------------------------------------------------------------------
+static void raw_packet(uint8_t *data, int bits, bool stuff)
+{
+  uint8_t samples[MAX_PACKET_SAMPLES];
+  int count = 0;
+  int ones = 0;
+  int level = 1;
+  uint32_t w = 0;
+
+  for (int i = 0; i < bits; i++)
+  {
+    int bit = (data[i / 8] >> (i % 8)) & 1;
+
+    if (!bit)
+      level ^= 1;
+
+    samples[count++] = level;
+
+    if (bit && ++ones == 6 && stuff)
+    {
+      level ^= 1;
+      samples[count++] = level;
+      ones = 0;
+    }
+    else if (!bit)
+    {
+      ones = 0;
+    }
+  }
+
+  samples[count++] = 0; // SE0
+
+  if (!raw_space(2 + decoder_packet_words(count)))
+    return;
+
+  g_raw_time += count * FS_BIT_TICKS;
+  g_raw[g_raw_ptr++] = count;
+  g_raw[g_raw_ptr++] = g_raw_time;
+  g_raw_time += PACKET_GAP_TICKS;
+  g_raw_count++;
+
+  for (int i = 0; i < count; i++)
+  {
+    w = (w << 1) | samples[i];
+
+    if ((i % 31) == 30)
+    {
+      g_raw[g_raw_ptr++] = w;
+      w = 0;
+    }
+  }
+
+  g_raw[g_raw_ptr++] = w;
+}
+
+//-----------------------------------------------------------------------------
+static void packet_token(int pid, int addr, int ep)
+{
+  uint16_t v = addr | (ep << 7);
+  uint8_t data[4] = { 0x80, pid | ((~pid & 0xf) << 4), 0, 0 };
+
+  for (int crc = 0; crc < 32; crc++)
+  {
+    data[2] = v;
+    data[3] = (v >> 8) | (crc << 3);
+
+    if (crc5_usb(&data[2], 2) == 0x09)
+      break;
+  }
+
+  raw_packet(data, sizeof(data) * 8, true);
+}
+
+//-----------------------------------------------------------------------------
+static void packet_sof(int frame)
+{
+  raw_frame();
+  packet_token(Pid_Sof, frame & 0x7f, (frame >> 7) & 0xf);
+}
+
+//-----------------------------------------------------------------------------
+static void packet_handshake(int pid)
+{
+  uint8_t data[2] = { 0x80, pid | ((~pid & 0xf) << 4) };
+  raw_packet(data, sizeof(data) * 8, true);
+}
+
+//-----------------------------------------------------------------------------
+static int data_packet(uint8_t *packet, const uint8_t *data, int size)
+{
+  int pid = g_toggle ? Pid_Data1 : Pid_Data0;
+  uint16_t crc;
+
+  packet[0] = 0x80;
+  packet[1] = pid | ((~pid & 0xf) << 4);
+  memcpy(&packet[2], data, size);
+
+  crc = ~crc16_usb(&packet[2], size);
+  packet[size+2] = crc;
+  packet[size+3] = crc >> 8;
+
+  g_toggle ^= 1;
+
+  return size + 4;
+}
+
+//-----------------------------------------------------------------------------
+static void packet_data(const uint8_t *data, int size)
+{
+  uint8_t packet[MAX_PACKET_SIZE];
+  int len = data_packet(packet, data, size);
+
+  raw_packet(packet, len * 8, true);
+}
+
+//-----------------------------------------------------------------------------
+static void random_data(uint8_t *data, int size)
+{
+  for (int i = 0; i < size; i++)
+    data[i] = rand_next();
+}
+
+//-----------------------------------------------------------------------------
+static void control_in(int addr, const uint8_t *setup, int size)
+{
+  uint8_t buf[64];
+
+  g_toggle = 0;
+  packet_token(Pid_Setup, addr, 0);
+  packet_data(setup, 8);
+  packet_handshake(Pid_Ack);
+
+  packet_token(Pid_In, addr, 0);
+  packet_handshake(Pid_Nak);
+
+  for (int i = 0; i < size; i += 64)
+  {
+    int len = (size - i) > 64 ? 64 : (size - i);
+
+    random_data(buf, len);
+    packet_token(Pid_In, addr, 0);
+    packet_data(buf, len);
+    packet_handshake(Pid_Ack);
+  }
+
+  g_toggle = 1;
+  packet_token(Pid_Out, addr, 0);
+  packet_data(buf, 0);
+  packet_handshake(Pid_Ack);
+}
+
+//-----------------------------------------------------------------------------
+static void generate_enumeration(void)
+{
+  static const uint8_t get_device[8] = { 0x80, 0x06, 0x00, 0x01, 0x00, 0x00, 0x12, 0x00 };
+  static const uint8_t get_config[8] = { 0x80, 0x06, 0x00, 0x02, 0x00, 0x00, 0xff, 0x00 };
+  static const uint8_t get_string[8] = { 0x80, 0x06, 0x02, 0x03, 0x09, 0x04, 0xff, 0x00 };
+  int frame = 0;
+
+  while (!g_raw_full)
+  {
+    raw_reset();
+
+    packet_sof(frame++);
+    control_in(0, get_device, 18);
+
+    for (int i = 0; i < 20 && !g_raw_full; i++)
+    {
+      packet_sof(frame++);
+
+      if (i % 4 == 0)
+        control_in(5, get_device, 18);
+      else if (i % 4 == 1)
+        control_in(5, get_config, 9 + 9 + 7 + 7 + 9);
+      else if (i % 4 == 2)
+        control_in(5, get_string, 2 + (i % 7) * 10);
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void generate_bulk(void)
+{
+  uint8_t buf[64];
+  int frame = 0;
+
+  raw_reset();
+  g_toggle = 0;
+
+  while (!g_raw_full)
+  {
+    packet_sof(frame++);
+
+    for (int i = 0; i < BULK_PACKETS_PER_FRAME; i++)
+    {
+      random_data(buf, sizeof(buf));
+      packet_token(Pid_In, 7, 1);
+      packet_data(buf, sizeof(buf));
+      packet_handshake(Pid_Ack);
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void generate_idle(void)
+{
+  int frame = 0;
+
+  raw_reset();
+
+  while (!g_raw_full)
+  {
+    packet_sof(frame++);
+    packet_token(Pid_In, 3, 2);
+    packet_handshake(Pid_Nak);
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void generate_errors(void)
+{
+  uint8_t buf[64];
+  uint8_t packet[MAX_PACKET_SIZE];
+  int frame = 0;
+
+  raw_reset();
+
+  while (!g_raw_full)
+  {
+    packet_sof(frame++);
+
+    for (int i = 0; i < BULK_PACKETS_PER_FRAME; i++)
+    {
+      int size = rand_next() % 65;
+      int len, type = rand_next() % 8;
+
+      random_data(buf, size);
+
+      if (type == 3 && size > 8) // Run of ones long enough to require stuffing
+        memset(buf, 0xff, 8);
+
+      len = data_packet(packet, buf, size);
+
+      if (type == 0) // CRC error
+        packet[2] ^= 0x10;
+      else if (type == 1) // PID error
+        packet[1] ^= 0x80;
+
+      packet_token(Pid_Out, 9, 3);
+      raw_packet(packet, (type == 2) ? (len * 8 - 3) : (len * 8), type != 3); // Partial byte, missing stuff bits
+      packet_handshake(type < 4 ? Pid_Nak : Pid_Ack);
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Reference decoder, NRZI decoding and unstuffing one bit at a time
+static int reference_packet(decoder_ctx_t *ctx, uint32_t *record, int size)
+{
+  decoder_t dec;
+
+  decoder_init(&dec, (uint8_t *)&record[2]);
+
+  while (size)
+  {
+    uint32_t w = ctx->buffer[ctx->rd_ptr++];
+    int bit_count = (size < 31) ? size : 31;
+    uint32_t v;
+
+    if (size < 31)
+      w <<= (30-size);
+
+    v = dec.v ^ (w ^ (w << 1));
+    dec.v = v << bit_count;
+
+    for (int i = 0; i < bit_count; i++)
+    {
+      int bit = (v & 0x80000000) ? 0 : 1;
+
+      v <<= 1;
+
+      if (dec.stuff == 6)
+      {
+        if (bit)
+          dec.error |= CAPTURE_ERROR_STUFF;
+
+        dec.stuff = 0;
+        continue;
+      }
+      else if (bit)
+        dec.stuff++;
+      else
+        dec.stuff = 0;
+
+      dec.byte |= (bit << dec.bit);
+      dec.bit++;
+
+      if (dec.bit == 8)
+      {
+        dec.out[dec.size++] = dec.byte;
+        dec.byte = 0;
+        dec.bit = 0;
+      }
+    }
+
+    size -= bit_count;
+  }
+
+  return decoder_finish(&dec, record, ctx->fs);
+}
+
+//-----------------------------------------------------------------------------
+static double time_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+//-----------------------------------------------------------------------------
+static uint64_t record_bytes(int count)
+{
+  uint64_t bytes = 0;
+  int ptr = 0;
+
+  for (int i = 0; i < count; i++)
+  {
+    int size = g_buffer[ptr] & CAPTURE_SIZE_MASK;
+
+    if (0 == (g_buffer[ptr] & CAPTURE_FOLDED))
+      bytes += size;
+
+    ptr += ((size + 3) / 4) + 2;
+  }
+
+  return bytes;
+}
+
+//-----------------------------------------------------------------------------
+// Decodes all raw packets with the decoder used by the firmware or with the reference
+// decoder. Returns the number of decoded bytes, or -1 if the two decoders don't agree.
+static int64_t decode_packets(bool reference, bool compare)
+{
+  static uint32_t record[DECODER_MAX_RECORD];
+  static uint32_t expected[DECODER_MAX_RECORD];
+  decoder_ctx_t ctx;
+  int64_t bytes = 0;
+  int ptr = 0;
+
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.buffer = g_raw;
+  ctx.fs = true;
+
+  for (int i = 0; i < g_raw_count; i++)
+  {
+    uint32_t size = g_raw[ptr];
+
+    if (size > 1)
+    {
+      int out_size;
+
+      ctx.rd_ptr = ptr + 2;
+
+      if (reference)
+        reference_packet(&ctx, record, size-1);
+      else
+        decoder_process_packet(&ctx, record, size-1);
+
+      out_size = record[0] & CAPTURE_SIZE_MASK;
+      bytes += out_size;
+
+      if (compare)
+      {
+        ctx.rd_ptr = ptr + 2;
+        reference_packet(&ctx, expected, size-1);
+
+        if (record[0] != expected[0] || memcmp(&record[2], &expected[2], out_size))
+          return -1;
+      }
+    }
+
+    ptr += 2 + decoder_packet_words(size);
+  }
+
+  return bytes;
+}
+
+//-----------------------------------------------------------------------------
+static void run_scenario(const scenario_t *scenario, int iterations)
+{
+  decoder_ctx_t ctx;
+  double process_time = 0.0;
+  double index_time = 0.0;
+  double display_time = 0.0;
+  double table_time = 0.0;
+  double bits_time = 0.0;
+  uint64_t bytes = 0;
+  uint64_t chars = 0;
+  int64_t decoded;
+
+  g_raw_ptr = 0;
+  g_raw_count = 0;
+  g_raw_full = false;
+  g_raw_time = 0;
+
+  scenario->generate();
+
+  decoded = decode_packets(false, true);
+
+  if (decoded < 0)
+  {
+    printf("%s: output differs from the reference decoder\n", scenario->name);
+    return;
+  }
+
+  for (int i = 0; i < iterations; i++)
+  {
+    double start;
+
+    start = time_now();
+    decode_packets(false, false);
+    table_time += time_now() - start;
+
+    start = time_now();
+    decode_packets(true, false);
+    bits_time += time_now() - start;
+
+    memcpy(g_buffer, g_raw, g_raw_ptr * sizeof(uint32_t));
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.buffer = g_buffer;
+    ctx.buffer_size = g_raw_ptr;
+    ctx.fs = true;
+    ctx.count = g_raw_count;
+    ctx.trigger_index = -1;
+
+    start = time_now();
+
+    if (!decoder_process_buffer(&ctx))
+    {
+      printf("%s: synchronization error\n", scenario->name);
+      return;
+    }
+
+    process_time += time_now() - start;
+    bytes += record_bytes(ctx.count);
+
+    // The firmware only indexes the raw buffer, the packets are decoded as they are displayed
+    memcpy(g_buffer, g_raw, g_raw_ptr * sizeof(uint32_t));
+
+    memset(&g_ctx, 0, sizeof(g_ctx));
+    g_ctx.buffer = g_buffer;
+    g_ctx.buffer_size = g_raw_ptr;
+    g_ctx.index = g_index;
+    g_ctx.frame_index = g_frame_index;
+    g_ctx.record = g_record;
+    g_ctx.fs = true;
+    g_ctx.count = g_raw_count;
+    g_ctx.trigger_index = -1;
+
+    start = time_now();
+
+    if (!decoder_index(&g_ctx))
+    {
+      printf("%s: synchronization error\n", scenario->name);
+      return;
+    }
+
+    decoder_open(&g_ctx);
+    index_time += time_now() - start;
+
+    memset(&g_buffer_info, 0, sizeof(g_buffer_info));
+    g_buffer_info.fs = true;
+    g_buffer_info.limit = -1;
+    g_buffer_info.count = g_raw_count;
+    g_buffer_info.trigger_index = -1;
+    g_buffer_info.duration = g_raw_time / CAPTURE_TICKS_PER_US;
+
+    g_output_count = 0;
+
+    start = time_now();
+
+    if (g_export)
+      display_pcapng();
+    else
+      display_buffer();
+
+    drain_output();
+    display_time += time_now() - start;
+
+    chars += g_output_count;
+
+    if (g_output)
+      g_output = NULL; // Output only the first iteration
+  }
+
+  printf("%-12s %8d %8d %10.0f %12.0f %9.2f %9.2f %12.0f %9.2f %10.2f %10.2f\n", scenario->name,
+      g_raw_count, ctx.count,
+      g_raw_count * (double)iterations / process_time, bytes / process_time,
+      process_time * 1000.0 / iterations, index_time * 1000.0 / iterations,
+      chars / display_time, display_time * 1000.0 / iterations,
+      table_time * 1e9 / iterations / decoded, bits_time * 1e9 / iterations / decoded);
+}
+
+//-----------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+  static const scenario_t scenarios[] =
+  {
+    { "enumeration", generate_enumeration },
+    { "bulk",        generate_bulk },
+    { "idle",        generate_idle },
+    { "errors",      generate_errors },
+  };
+  int iterations = DEFAULT_ITERATIONS;
+  const char *name = NULL;
+  FILE *output = NULL;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (0 == strcmp(argv[i], "-n") && (i+1) < argc)
+    {
+      iterations = atoi(argv[++i]);
+    }
+    else if (0 == strcmp(argv[i], "-o") && (i+1) < argc)
+    {
+      output = fopen(argv[++i], "wb");
+
+      if (!output)
+      {
+        perror(argv[i]);
+        return 1;
+      }
+    }
+    else if (0 == strcmp(argv[i], "-b"))
+    {
+      g_display_output = DisplayOutput_Binary;
+    }
+    else if (0 == strcmp(argv[i], "-f") && (i+1) < argc)
+    {
+      g_display_filter = atoi(argv[++i]) % DisplayFilterCount;
+    }
+    else if (0 == strcmp(argv[i], "-t"))
+    {
+      g_display_view = DisplayView_Transactions;
+    }
+    else if (0 == strcmp(argv[i], "-x"))
+    {
+      g_export = true;
+    }
+    else if (argv[i][0] != '-')
+    {
+      name = argv[i];
+    }
+    else
+    {
+      printf("usage: %s [-n iterations] [-o output] [-b] [-x] [-f filter] [-t] [scenario]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  if (iterations < 1)
+    iterations = 1;
+
+  printf("%-12s %8s %8s %10s %12s %9s %9s %12s %9s %10s %10s\n", "Scenario", "Raw", "Records",
+      "Packets/s", "Bytes/s", "Proc, ms", "Index, ms", "Chars/s", "Disp, ms", "Table ns/B", "Bits ns/B");
+
+  for (int i = 0; i < (int)(sizeof(scenarios) / sizeof(scenarios[0])); i++)
+  {
+    if (name && strcmp(name, scenarios[i].name))
+      continue;
+
+    g_output = output;
+    run_scenario(&scenarios[i], iterations);
+  }
+
+  if (output)
+    fclose(output);
+
+  return 0;
+}
@@ -0,0 +1,385 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2022, Alex Taradov <alex@taradov.com>. All rights reserved.
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "capture.h"
+#include "decoder.h"
+
+/*- Definitions -------------------------------------------------------------*/
+#define HEADER_SIZE            5
+#define MAX_RECORD_SIZE        (2 + (0xffff / 8 + 3) / 4)
+#define MAX_INPUT_SIZE         (1024 * 1024)
+
+#define CHECK(cond) \
+  do { if (!(cond)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); abort(); } } while (0)
+
+/*- Variables ---------------------------------------------------------------*/
+static uint32_t g_record[MAX_RECORD_SIZE];
+
+/*- Implementations ---------------------------------------------------------*/
+
+//-----------------------------------------------------------------------------
+static void check_records(decoder_ctx_t *ctx)
+{
+  int ptr = 0;
+
+  CHECK(ctx->wr_ptr <= ctx->rd_ptr);
+  CHECK(ctx->rd_ptr <= ctx->buffer_size);
+
+  for (int i = 0; i < ctx->count; i++)
+  {
+    CHECK((ptr + 2) <= ctx->wr_ptr);
+    ptr += 2 + ((ctx->buffer[ptr] & CAPTURE_SIZE_MASK) + 3) / 4;
+  }
+
+  CHECK(ptr == ctx->wr_ptr);
+}
+
+//-----------------------------------------------------------------------------
+// Decode each packet again from the unmodified raw data into a separate record,
+// any difference means that the in-place decoding overwrote its own input
+static void check_in_place(decoder_ctx_t *ctx, uint32_t *raw)
+{
+  decoder_ctx_t ref = *ctx;
+  uint32_t mask = CAPTURE_ERROR_MASK | CAPTURE_SIZE_MASK;
+  int rd_ptr = 0;
+  int wr_ptr = 0;
+
+  ref.buffer = raw;
+
+  while (wr_ptr < ctx->wr_ptr)
+  {
+    uint32_t size, *record;
+
+    CHECK((rd_ptr + 2) <= ctx->buffer_size);
+
+    size = raw[rd_ptr] & ~CAPTURE_RAW_OVERFLOW;
+    record = &ctx->buffer[wr_ptr];
+
+    if (size == CAPTURE_RAW_FOLD)
+    {
+      rd_ptr += 4;
+      wr_ptr += 4;
+    }
+    else if (size == 0)
+    {
+      rd_ptr += 2;
+      wr_ptr += 2;
+    }
+    else if (size == 1)
+    {
+      rd_ptr += 3;
+      wr_ptr += ctx->fs ? 0 : 2;
+    }
+    else
+    {
+      int record_size;
+
+      ref.rd_ptr = rd_ptr + 2;
+      decoder_process_packet(&ref, g_record, size-1);
+
+      CHECK(ref.rd_ptr <= (rd_ptr + 2 + decoder_packet_words(size)));
+      CHECK((record[0] & mask) == (g_record[0] & mask));
+
+      record_size = g_record[0] & CAPTURE_SIZE_MASK;
+      CHECK(0 == memcmp(&record[2], &g_record[2], record_size));
+
+      rd_ptr += 2 + decoder_packet_words(size);
+      wr_ptr += 2 + (record_size + 3) / 4;
+    }
+  }
+
+  CHECK(wr_ptr == ctx->wr_ptr);
+}
+
+//-----------------------------------------------------------------------------
+// Packet records have the token fields before the packet bytes
+static void check_record(uint32_t *record, uint32_t *ref, uint32_t mask)
+{
+  CHECK((record[0] & mask) == (ref[0] & mask));
+  CHECK(record[1] == ref[1]);
+  CHECK(record[2] == decoder_fields(ref[0], (uint8_t *)&ref[2]));
+  CHECK(0 == memcmp(&record[3], &ref[2], record[0] & CAPTURE_SIZE_MASK));
+}
+
+//-----------------------------------------------------------------------------
+static bool packet_carries_markers(decoder_ctx_t *ctx, uint32_t *raw, int ptr)
+{
+  uint32_t size = raw[ptr] & ~CAPTURE_RAW_OVERFLOW;
+  return size == CAPTURE_RAW_FOLD || (ctx->fs && size == 1);
+}
+
+//-----------------------------------------------------------------------------
+// The overflow markers carried over the start of the index entry are lost on seek
+static bool marker_lost(decoder_ctx_t *ctx, uint32_t *raw, int *offsets, int index)
+{
+  int start = index & ~(DECODER_INDEX_STEP-1);
+
+  if (start == 0)
+    return false;
+
+  for (int i = start - 1; i < index; i++)
+  {
+    if (!packet_carries_markers(ctx, raw, offsets[i]))
+      return false;
+  }
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+static void check_frames(decoder_ctx_t *ctx)
+{
+  int prev = 0;
+
+  for (uint32_t frame = 0; frame < 64; frame++)
+  {
+    int packet = decoder_frame_packet(ctx, frame);
+
+    if (packet < 0)
+    {
+      CHECK(decoder_frame_packet(ctx, frame + 1000) < 0);
+      break;
+    }
+
+    CHECK(packet >= prev && packet < ctx->count);
+    prev = packet;
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Decode the same raw buffer on demand and compare the records and statistics
+// with the ones produced by the whole buffer processing
+static void check_lazy(decoder_ctx_t *ctx, uint32_t *raw, int count, int trigger_index)
+{
+  int limit = (DECODER_MAX_RECORD - 4) * 31;
+  decoder_ctx_t lazy;
+  int *records, *offsets;
+  int ptr = 0, wr_ptr = 0;
+
+  memset(&lazy, 0, sizeof(lazy));
+  lazy.buffer = raw;
+  lazy.buffer_size = ctx->buffer_size;
+  lazy.fs = ctx->fs;
+  lazy.count = count;
+  lazy.trigger_index = trigger_index;
+
+  // Truncated packets are not comparable with the full decoding
+  for (int i = 0; i < count; i++)
+  {
+    uint32_t size = raw[ptr] & ~CAPTURE_RAW_OVERFLOW;
+
+    if (size != CAPTURE_RAW_FOLD && (int)size-1 > limit)
+      return;
+
+    ptr += (size == CAPTURE_RAW_FOLD) ? 4 : (2 + decoder_packet_words(size));
+  }
+
+  lazy.index = malloc(((count >> DECODER_INDEX_SHIFT) + 1) * sizeof(uint32_t));
+  lazy.frame_index = malloc(((count >> DECODER_INDEX_SHIFT) + 1) * sizeof(uint32_t));
+  lazy.record = malloc(DECODER_MAX_RECORD * sizeof(uint32_t));
+  records = malloc((count + 1) * sizeof(int));
+  offsets = malloc((count + 1) * sizeof(int));
+
+  CHECK(decoder_index(&lazy));
+  decoder_open(&lazy);
+
+  for (int i = 0; i < count; i++)
+  {
+    uint32_t *record = decoder_packet(&lazy, i);
+    uint32_t *ref = &ctx->buffer[wr_ptr];
+
+    offsets[i] = lazy.packet_ptr;
+    records[i] = record ? wr_ptr : -1;
+
+    if (!record)
+      continue;
+
+    CHECK(wr_ptr < ctx->wr_ptr);
+    check_record(record, ref, ~0u);
+
+    wr_ptr += 2 + ((ref[0] & CAPTURE_SIZE_MASK) + 3) / 4;
+  }
+
+  CHECK(wr_ptr == ctx->wr_ptr);
+  CHECK(lazy.errors == ctx->errors);
+  CHECK(lazy.resets == ctx->resets);
+  CHECK(lazy.frames == ctx->frames);
+  CHECK(lazy.folded == ctx->folded);
+
+  // Random access
+  for (int j = 0; j < count && j < 64; j++)
+  {
+    int i = (j * 7919) % count;
+    uint32_t *record = decoder_packet(&lazy, i);
+
+    CHECK(lazy.packet_ptr == offsets[i]);
+    CHECK((record != NULL) == (records[i] >= 0));
+
+    if (record)
+    {
+      uint32_t *ref = &ctx->buffer[records[i]];
+      uint32_t mask = marker_lost(&lazy, raw, offsets, i) ? ~(uint32_t)CAPTURE_OVERFLOW : ~0u;
+
+      check_record(record, ref, mask);
+    }
+  }
+
+  check_frames(&lazy);
+
+  free(lazy.index);
+  free(lazy.frame_index);
+  free(lazy.record);
+  free(records);
+  free(offsets);
+}
+
+//-----------------------------------------------------------------------------
+// Store the decoded records in the compact format and compare the packets
+// decoded on demand from it with the original records
+static void check_compact(decoder_ctx_t *ctx)
+{
+  int size = ctx->wr_ptr * sizeof(uint32_t) + DECODER_COMPACT_HEADER;
+  decoder_ctx_t compact;
+  uint8_t *buffer;
+  int *offsets;
+  uint32_t time = 0;
+  int ptr = 0, wr_ptr = 0;
+
+  if (ctx->count == 0)
+    return;
+
+  buffer = malloc(size);
+  offsets = malloc(ctx->count * sizeof(int));
+
+  for (int i = 0; i < ctx->count; i++)
+  {
+    uint32_t *record = &ctx->buffer[ptr];
+    uint32_t delta = (i & (DECODER_INDEX_STEP-1)) ? (record[1] - time) : record[1];
+
+    if ((record[0] & CAPTURE_SIZE_MASK) > DECODER_MAX_DATA)
+    {
+      free(buffer);
+      free(offsets);
+      return;
+    }
+
+    wr_ptr += decoder_compact_record(&buffer[wr_ptr], record[0], delta, (uint8_t *)&record[2]);
+    CHECK(wr_ptr <= size);
+
+    offsets[i] = ptr;
+    time = record[1];
+    ptr += 2 + ((record[0] & CAPTURE_SIZE_MASK) + 3) / 4;
+  }
+
+  memset(&compact, 0, sizeof(compact));
+  compact.buffer = (uint32_t *)buffer;
+  compact.buffer_size = size / sizeof(uint32_t);
+  compact.fs = ctx->fs;
+  compact.count = ctx->count;
+  compact.trigger_index = -1;
+  compact.decoded = true;
+
+  compact.index = malloc(((ctx->count >> DECODER_INDEX_SHIFT) + 1) * sizeof(uint32_t));
+  compact.frame_index = malloc(((ctx->count >> DECODER_INDEX_SHIFT) + 1) * sizeof(uint32_t));
+  compact.record = malloc(DECODER_MAX_RECORD * sizeof(uint32_t));
+
+  CHECK(decoder_index(&compact));
+  decoder_open(&compact);
+
+  // Sequential, then random access
+  for (int j = 0; j < ctx->count + 64; j++)
+  {
+    int i = (j < ctx->count) ? j : ((j * 7919) % ctx->count);
+    uint32_t *record = decoder_packet(&compact, i);
+    uint32_t *ref = &ctx->buffer[offsets[i]];
+
+    CHECK(record != NULL);
+    check_record(record, ref, ~0u);
+  }
+
+  check_frames(&compact);
+
+  free(compact.index);
+  free(compact.frame_index);
+  free(compact.record);
+  free(buffer);
+  free(offsets);
+}
+
+//-----------------------------------------------------------------------------
+// Input: flags (1 byte), packet count (2 bytes), trigger index (2 bytes),
+// followed by the raw buffer words
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+  decoder_ctx_t ctx;
+  uint32_t *buffer, *raw;
+  int words, count, trigger_index;
+
+  if (size < HEADER_SIZE || size > MAX_INPUT_SIZE)
+    return 0;
+
+  words = (size - HEADER_SIZE) / sizeof(uint32_t);
+
+  // Allocations of the exact size, so the sanitizer catches any access past the end
+  buffer = malloc(words * sizeof(uint32_t) + 1);
+  raw = malloc(words * sizeof(uint32_t) + 1);
+  memcpy(buffer, &data[HEADER_SIZE], words * sizeof(uint32_t));
+  memcpy(raw, buffer, words * sizeof(uint32_t));
+
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.buffer = buffer;
+  ctx.buffer_size = words;
+  ctx.fs = data[0] & 1;
+  ctx.count = count = data[1] | (data[2] << 8);
+  ctx.trigger_index = trigger_index = (int16_t)(data[3] | (data[4] << 8));
+
+  if (decoder_process_buffer(&ctx))
+  {
+    check_records(&ctx);
+    check_in_place(&ctx, raw);
+    check_lazy(&ctx, raw, count, trigger_index);
+    check_compact(&ctx);
+  }
+  else
+  {
+    CHECK(ctx.count == 0);
+  }
+
+  free(buffer);
+  free(raw);
+
+  return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+//-----------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+  static uint8_t data[MAX_INPUT_SIZE];
+
+  for (int i = 1; i < argc; i++)
+  {
+    FILE *f = fopen(argv[i], "rb");
+    size_t size;
+
+    if (!f)
+    {
+      perror(argv[i]);
+      return 1;
+    }
+
+    size = fread(data, 1, sizeof(data), f);
+    fclose(f);
+
+    LLVMFuzzerTestOneInput(data, size);
+  }
+
+  return 0;
+}
+#endif
@@ -0,0 +1,130 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2022, Alex Taradov <alex@taradov.com>. All rights reserved.
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "rp2040.h"
+#include "capture.h"
+#include "display.h"
+#include "globals.h"
+
+/*- Definitions -------------------------------------------------------------*/
+#define OUTPUT_CHUNK           64 // Size of the USB buffer on the device
+#define MAX_FRAME_SIZE         (DISPLAY_FRAME_HEADER + 0xffff)
+
+/*- Variables ---------------------------------------------------------------*/
+uint32_t g_buffer[BUFFER_SIZE];
+buffer_info_t g_buffer_info;
+
+int g_capture_speed      = CaptureSpeed_Full;
+int g_capture_mode       = CaptureMode_Polling;
+int g_capture_trigger    = CaptureTrigger_Disabled;
+int g_capture_pretrigger = CapturePretrigger_None;
+int g_capture_limit      = CaptureLimit_Unlimited;
+int g_capture_fold       = CaptureFold_Disabled;
+int g_capture_decode     = CaptureDecode_Disabled;
+int g_display_time       = DisplayTime_First;
+int g_display_data       = DisplayData_Full;
+int g_display_fold       = DisplayFold_Enabled;
+int g_display_filter     = DisplayFilter_All;
+uint32_t g_display_address[4] = { 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff };
+uint32_t g_display_endpoint   = 0xffff;
+int g_display_view       = DisplayView_Packets;
+int g_display_output     = DisplayOutput_Text;
+
+static uint8_t g_frame[MAX_FRAME_SIZE];
+
+/*- Implementations ---------------------------------------------------------*/
+
+//-----------------------------------------------------------------------------
+static void drain_output(void)
+{
+  uint8_t data[OUTPUT_CHUNK];
+  int size;
+
+  while ((size = display_read(data, sizeof(data))) > 0)
+    fwrite(data, 1, size, stdout);
+}
+
+//-----------------------------------------------------------------------------
+uint32_t *capture_packet(int index, uint32_t skip)
+{
+  (void)index;
+  (void)skip;
+  return NULL;
+}
+
+//-----------------------------------------------------------------------------
+void set_error(bool error)
+{
+  (void)error;
+}
+
+//-----------------------------------------------------------------------------
+void capture_stream_task(void)
+{
+  drain_output();
+}
+
+//-----------------------------------------------------------------------------
+static bool read_frame(FILE *f)
+{
+  int size;
+
+  if (fread(&g_frame[1], 1, DISPLAY_FRAME_HEADER-1, f) != DISPLAY_FRAME_HEADER-1)
+    return false;
+
+  size = g_frame[2] | (g_frame[3] << 8);
+
+  if (fread(&g_frame[DISPLAY_FRAME_HEADER], 1, size, f) != (size_t)size)
+    return false;
+
+  display_frame(g_frame[1], &g_frame[DISPLAY_FRAME_HEADER], size);
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// Renders the binary output of the sniffer as text. The text parts of the output
+// are passed through, the frames are formatted with the firmware display code.
+int main(int argc, char *argv[])
+{
+  FILE *f = stdin;
+  int c;
+
+  if (argc > 2 || (argc == 2 && argv[1][0] == '-'))
+  {
+    printf("usage: %s [input]\n", argv[0]);
+    return 1;
+  }
+
+  if (argc == 2)
+  {
+    f = fopen(argv[1], "rb");
+
+    if (!f)
+    {
+      perror(argv[1]);
+      return 1;
+    }
+  }
+
+  while ((c = fgetc(f)) != EOF)
+  {
+    if (c != DISPLAY_FRAME_SYNC)
+      display_putc(c);
+    else if (!read_frame(f))
+      break;
+  }
+
+  drain_output();
+
+  if (f != stdin)
+    fclose(f);
+
+  return 0;
+}
@@ -0,0 +1,17 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2022, Alex Taradov <alex@taradov.com>. All rights reserved.
+
+#ifndef _HOST_RP2040_H_
+#define _HOST_RP2040_H_
+
+// Host replacement for the device header. Only the barrier used by the display
+// output ring is provided, the host side drains the ring with display_read()
+// from the same thread, so a compiler barrier is enough.
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdint.h>
+
+/*- Definitions -------------------------------------------------------------*/
+#define __DMB()                __asm__ volatile ("" ::: "memory")
+
+#endif // _HOST_RP2040_H_
@@ -9,6 +9,7 @@
 #include "rp2040.h"
 #include "hal_gpio.h"
 #include "capture.h"
+#include "display.h"
 #include "globals.h"
 #include "utils.h"
 #include "usb.h"
@@ -29,10 +30,8 @@ HAL_GPIO_PIN(LED_R, 0, 26, sio_26)
 
 /*- Variables ---------------------------------------------------------------*/
 static uint8_t app_recv_buffer[USB_BUFFER_SIZE];
-static uint8_t app_send_buffer[USB_BUFFER_SIZE];
 static int app_send_buffer_ptr = 0;
 static bool app_send_zlp = false;
-static bool app_send_pending = false;
 static bool app_recv_pending = false;
 static bool app_vcp_open = false;
 
@@ -155,53 +154,57 @@ static bool vcp_timeout(void)
 //-----------------------------------------------------------------------------
 static void send_buffer(void)
 {
-  usb_cdc_send(app_send_buffer, app_send_buffer_ptr);
+  usb_cdc_send_buffer(app_send_buffer_ptr);
 
   app_send_zlp = (USB_BUFFER_SIZE == app_send_buffer_ptr);
-  app_send_pending = true;
   app_send_buffer_ptr = 0;
 }
 
 //-----------------------------------------------------------------------------
 void usb_cdc_send_callback(void)
 {
-  app_send_pending = false;
+  // The free buffers are checked by display_task()
 }
 
 //-----------------------------------------------------------------------------
+// The output is copied directly into the free USB buffer, one buffer is
+// filled while the other one is sent
 static void display_task(void)
 {
+  uint8_t *buf;
+  int size;
+
   if (!app_vcp_open)
   {
-    while (SIO->FIFO_ST & SIO_FIFO_ST_VLD_Msk)
-      (void)SIO->FIFO_RD;
+    display_discard();
     return;
   }
 
-  if (app_send_pending)
+  if (NULL == (buf = usb_cdc_get_send_buffer()))
     return;
 
-  while (SIO->FIFO_ST & SIO_FIFO_ST_VLD_Msk)
-  {
-    app_send_buffer[app_send_buffer_ptr++] = SIO->FIFO_RD;
+  size = display_read(&buf[app_send_buffer_ptr], USB_BUFFER_SIZE - app_send_buffer_ptr);
+
+  if (0 == size)
+    return;
 
-    reset_vcp_timeout();
+  app_send_buffer_ptr += size;
+  reset_vcp_timeout();
 
-    if (USB_BUFFER_SIZE == app_send_buffer_ptr)
-    {
-      send_buffer();
-      break;
-    }
-  }
+  if (USB_BUFFER_SIZE == app_send_buffer_ptr)
+    send_buffer();
 }
 
 //-----------------------------------------------------------------------------
 static void vcp_timer_task(void)
 {
-  if (vcp_timeout())
+  if (vcp_timeout() && (app_send_zlp || app_send_buffer_ptr))
   {
-    if (app_send_zlp || app_send_buffer_ptr)
+    // The partially filled buffer is always free, only the ZLP may need to wait
+    if (usb_cdc_get_send_buffer())
       send_buffer();
+    else
+      reset_vcp_timeout();
   }
 }
 
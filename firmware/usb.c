@@ -16,6 +16,7 @@
 #define USB_DPRAM              ((usb_dpram_t *)USBCTRL_DPRAM_BASE)
 #define USB_DPRAM_FIXED_SIZE   0x100
 #define USB_DPRAM_BUF_OFFSET   (USB_DPRAM_FIXED_SIZE + USB_CTRL_EP_SIZE*2)
+#define USB_DOUBLE_BUF_OFFSET  64 // The second buffer of a double buffered endpoint
 
 /*- Types -------------------------------------------------------------------*/
 typedef struct
@@ -41,6 +42,8 @@ typedef struct
 typedef struct
 {
   int      in_pid;
+  int      in_next;   // Buffer to be filled next, the controller alternates between the two
+  bool     in_double;
   volatile uint8_t *in_buf;
   int      out_pid;
   volatile uint8_t *out_buf;
@@ -134,12 +137,24 @@ void usb_configure_endpoint(usb_endpoint_descriptor_t *desc)
 
   if (USB_IN_ENDPOINT == dir)
   {
+    // Bulk IN endpoints are double buffered, so that the next packet can be
+    // filled while the previous one is sent
+    bool dbl = (USB_BULK_ENDPOINT == type && 64 == size);
+
     usb_ep[ep].in_buf = (volatile uint8_t *)(USBCTRL_DPRAM_BASE + usb_ep_buf_ptr);
+    usb_ep[ep].in_double = dbl;
+    usb_ep[ep].in_next = 0;
+
+    USB_DPRAM->EP_BUF_CTRL[ep].IN = dbl ? USBCTRL_DPRAM_EP1_IN_BUFFER_CONTROL_RESET_Msk : 0;
 
     USB_DPRAM->EP_CTRL[ep-1].IN = USBCTRL_DPRAM_EP1_IN_CONTROL_ENABLE_Msk |
         USBCTRL_DPRAM_EP1_IN_CONTROL_INTERRUPT_PER_BUFF_Msk |
+        (dbl ? USBCTRL_DPRAM_EP1_IN_CONTROL_DOUBLE_BUFFERED_Msk : 0) |
         (type << USBCTRL_DPRAM_EP1_IN_CONTROL_ENDPOINT_TYPE_Pos) |
         (usb_ep_buf_ptr << USBCTRL_DPRAM_EP1_IN_CONTROL_BUFFER_ADDRESS_Pos);
+
+    if (dbl)
+      usb_ep_buf_ptr += USB_DOUBLE_BUF_OFFSET;
   }
   else
   {
@@ -187,7 +202,12 @@ void usb_endpoint_clear_feature(int ep, int dir)
   if (USB_IN_ENDPOINT == dir)
   {
     usb_ep[ep].in_pid = 0;
-    USB_DPRAM->EP_BUF_CTRL[ep].IN &= ~USBCTRL_DPRAM_EP0_IN_BUFFER_CONTROL_STALL_Msk;
+    usb_ep[ep].in_next = 0;
+
+    if (usb_ep[ep].in_double)
+      USB_DPRAM->EP_BUF_CTRL[ep].IN = USBCTRL_DPRAM_EP0_IN_BUFFER_CONTROL_RESET_Msk;
+    else
+      USB_DPRAM->EP_BUF_CTRL[ep].IN &= ~USBCTRL_DPRAM_EP0_IN_BUFFER_CONTROL_STALL_Msk;
   }
   else
   {
@@ -202,6 +222,15 @@ void usb_set_address(int address)
   USBCTRL_REGS->ADDR_ENDP = address;
 }
 
+//-----------------------------------------------------------------------------
+static volatile uint16_t *usb_in_buffer_control(int ep)
+{
+  // Each buffer has its own half of the control register with the same layout.
+  // The halves are written separately, so that the controller updates of the other
+  // buffer are not overwritten.
+  return (volatile uint16_t *)&USB_DPRAM->EP_BUF_CTRL[ep].IN + usb_ep[ep].in_next;
+}
+
 //-----------------------------------------------------------------------------
 static void usb_start_in_transfer(int ep, int size)
 {
@@ -209,6 +238,21 @@ static void usb_start_in_transfer(int ep, int size)
       (usb_ep[ep].in_pid ? USBCTRL_DPRAM_EP0_IN_BUFFER_CONTROL_PID_0_Msk : 0);
   usb_ep[ep].in_pid ^= 1;
 
+  if (usb_ep[ep].in_double)
+  {
+    volatile uint16_t *ctrl = usb_in_buffer_control(ep);
+
+    usb_ep[ep].in_next ^= 1;
+
+    *ctrl = v;
+    asm("nop");
+    asm("nop");
+    asm("nop");
+    asm("nop");
+    *ctrl = v | USBCTRL_DPRAM_EP0_IN_BUFFER_CONTROL_AVAILABLE_0_Msk;
+    return;
+  }
+
   USB_DPRAM->EP_BUF_CTRL[ep].IN = v;
   asm("nop");
   asm("nop");
@@ -234,9 +278,28 @@ static void usb_start_out_transfer(int ep, int size)
 //-----------------------------------------------------------------------------
 void usb_send(int ep, uint8_t *data, int size)
 {
+  volatile uint8_t *buf = usb_ep[ep].in_buf + usb_ep[ep].in_next * USB_DOUBLE_BUF_OFFSET;
+
   for (int i = 0; i < size; i++)
-    usb_ep[ep].in_buf[i] = data[i];
+    buf[i] = data[i];
+
+  usb_start_in_transfer(ep, size);
+}
+
+//-----------------------------------------------------------------------------
+// Returns the IN buffer to be filled next, or NULL if it is still in use by the controller.
+// The data may be written directly into the buffer and then sent with usb_send_buffer().
+uint8_t *usb_get_send_buffer(int ep)
+{
+  if (*usb_in_buffer_control(ep) & USBCTRL_DPRAM_EP0_IN_BUFFER_CONTROL_AVAILABLE_0_Msk)
+    return NULL;
+
+  return (uint8_t *)(usb_ep[ep].in_buf + usb_ep[ep].in_next * USB_DOUBLE_BUF_OFFSET);
+}
 
+//-----------------------------------------------------------------------------
+void usb_send_buffer(int ep, int size)
+{
   usb_start_in_transfer(ep, size);
 }
 
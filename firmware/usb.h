@@ -23,6 +23,8 @@ void usb_endpoint_set_feature(int ep, int dir);
 void usb_endpoint_clear_feature(int ep, int dir);
 void usb_set_address(int address);
 void usb_send(int ep, uint8_t *data, int size);
+uint8_t *usb_get_send_buffer(int ep);
+void usb_send_buffer(int ep, int size);
 void usb_recv(int ep, uint8_t *data, int size);
 void usb_control_send_zlp(void);
 void usb_control_stall(void);
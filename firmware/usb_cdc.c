@@ -63,6 +63,18 @@ void usb_cdc_send(uint8_t *data, int size)
   usb_send(USB_CDC_EP_SEND, data, size);
 }
 
+//-----------------------------------------------------------------------------
+uint8_t *usb_cdc_get_send_buffer(void)
+{
+  return usb_get_send_buffer(USB_CDC_EP_SEND);
+}
+
+//-----------------------------------------------------------------------------
+void usb_cdc_send_buffer(int size)
+{
+  usb_send_buffer(USB_CDC_EP_SEND, size);
+}
+
 //-----------------------------------------------------------------------------
 void usb_cdc_recv(uint8_t *data, int size)
 {
@@ -196,6 +196,8 @@ typedef struct PACK
 void usb_cdc_init(void);
 bool usb_cdc_handle_request(usb_request_t *request);
 void usb_cdc_send(uint8_t *data, int size);
+uint8_t *usb_cdc_get_send_buffer(void);
+void usb_cdc_send_buffer(int size);
 void usb_cdc_recv(uint8_t *data, int size);
 void usb_cdc_set_state(int mask);
 void usb_cdc_clear_state(int mask);
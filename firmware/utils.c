@@ -9,6 +9,7 @@
 //-----------------------------------------------------------------------------
 void hw_divmod_u32(uint32_t dividend, uint32_t divisor, uint32_t *quotient, uint32_t *remainder)
 {
+#if defined(__arm__)
   asm volatile (R"asm(
     movs       r6, #0xd0
     lsl        r6, r6, #24 // r2 = SIO_BASE
@@ -27,11 +28,16 @@ void hw_divmod_u32(uint32_t dividend, uint32_t divisor, uint32_t *quotient, uint
     : [dividend] "r" (dividend), [divisor] "r" (divisor)
     : "r6", "r7"
   );
+#else
+  *quotient = dividend / divisor;
+  *remainder = dividend % divisor;
+#endif
 }
 
 //-----------------------------------------------------------------------------
 void hw_divmod_s32(int32_t dividend, int32_t divisor, int32_t *quotient, int32_t *remainder)
 {
+#if defined(__arm__)
   asm volatile (R"asm(
     movs       r6, #0xd0
     lsl        r6, r6, #24 // r2 = SIO_BASE
@@ -50,6 +56,10 @@ void hw_divmod_s32(int32_t dividend, int32_t divisor, int32_t *quotient, int32_t
     : [dividend] "r" (dividend), [divisor] "r" (divisor)
     : "r6", "r7"
   );
+#else
+  *quotient = dividend / divisor;
+  *remainder = dividend % divisor;
+#endif
 }
 
 //-----------------------------------------------------------------------------